@@ -0,0 +1,420 @@
+/* disk_aio.c
+ *
+ * Asynchronous submission queue in front of the disk emulator. Callers queue
+ * block reads and writes with disk_submit_read/disk_submit_write and collect
+ * completions later with disk_reap, so several requests stay in flight while
+ * the caller keeps working.
+ *
+ * Two engines sit behind the same API:
+ *   - io_uring, used on Linux when the image is driven by the pread backend
+ *     and the device model is free (see disk_direct_fd()). Requests go straight
+ *     from the ring to the image descriptor.
+ *   - a pool of worker threads calling read_blocks/write_blocks, used for every
+ *     other backend, for modelled devices (the model stalls overlap across
+ *     workers) and where the kernel has no io_uring.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "disk_emu.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE  // <linux/fs.h> defines one, ours is the disk_emu.c global
+#endif
+
+#define AIO_DEFAULT_DEPTH 64
+#define AIO_WORKERS 4
+#define AIO_URING_BATCH 16  // sqes queued before io_uring_enter is called
+
+extern int BLOCK_SIZE, MAX_BLOCK;
+
+typedef struct {
+    int is_write;
+    int start_address;
+    int nblocks;
+    void *buffer;
+    void *user_data;
+} aio_request;
+
+static int aio_engine = -1;  // -1 when the queue is not set up
+static int aio_requested;    // engine asked for, DISK_AIO_AUTO for the lazy setup
+static int aio_fd;           // disk_direct_fd() when the engine was picked
+static int aio_depth;
+static int aio_inflight;     // submitted, not yet completed
+static int aio_ready_count;  // completed, not yet reaped
+static int aio_ready_size;
+static aio_request *aio_slots;     // io_uring: request per slot, indexed by user_data
+static int *aio_free_slots;
+static int aio_free_count;
+static disk_completion *aio_ready; // completions waiting for disk_reap
+
+// Setting the queue up and tearing it down, against the lazy setup in submit()
+static pthread_mutex_t aio_setup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Thread pool state, aio_lock also guards the ring and the ready list of io_uring
+static pthread_t aio_threads[AIO_WORKERS];
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t aio_done = PTHREAD_COND_INITIALIZER;
+static aio_request *aio_queue;     // circular queue of pending requests
+static int aio_queue_head, aio_queue_count;
+static int aio_stopping;
+
+// Appends a completion to the ready list, growing it when the caller falls behind
+static void ready_push(void *user_data, int result) {
+    if (aio_ready_count == aio_ready_size) {
+        aio_ready_size *= 2;
+        aio_ready = realloc(aio_ready, aio_ready_size * sizeof(disk_completion));
+    }
+    aio_ready[aio_ready_count].user_data = user_data;
+    aio_ready[aio_ready_count].result = result;
+    aio_ready_count++;
+}
+
+// ---------------------------- io_uring engine ---------------------------------
+#ifdef __linux__
+static struct {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned unsubmitted;  // sqes queued but not yet handed to the kernel
+} ring = { -1 };
+
+static int uring_setup(unsigned entries) {
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0) return -1;
+    ring.unsubmitted = 0;
+
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sq_ptr == MAP_FAILED || ring.cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        close(ring.fd);
+        ring.fd = -1;
+        return -1;
+    }
+
+    ring.sq_head = (unsigned *)((char *)ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((char *)ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((char *)ring.sq_ptr + p.sq_off.array);
+    ring.cq_head = (unsigned *)((char *)ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((char *)ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown() {
+    munmap(ring.sqes, ring.sqes_len);
+    munmap(ring.cq_ptr, ring.cq_len);
+    munmap(ring.sq_ptr, ring.sq_len);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+// Hands every queued sqe to the kernel, optionally waiting for one completion
+static int uring_enter(int wait) {
+    int n;
+
+    do {
+        n = syscall(__NR_io_uring_enter, ring.fd, ring.unsubmitted, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) return -1;
+    ring.unsubmitted -= n;
+    return 0;
+}
+
+// Queues one read/write sqe, entering the kernel once a batch has built up
+static int uring_submit(int slot) {
+    aio_request *req = &aio_slots[slot];
+    unsigned tail = *ring.sq_tail;
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = req->is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = disk_direct_fd();
+    sqe->addr = (unsigned long)req->buffer;
+    sqe->len = req->nblocks * BLOCK_SIZE;
+    sqe->off = (unsigned long long)req->start_address * BLOCK_SIZE;
+    sqe->user_data = slot;
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.unsubmitted++;
+
+    if (ring.unsubmitted >= AIO_URING_BATCH) return uring_enter(0);
+    return 0;
+}
+
+// Waits for at least one cqe when asked to, then moves every cqe to the ready list
+static void uring_collect(int wait) {
+    unsigned head;
+
+    if (wait || ring.unsubmitted > 0) uring_enter(wait);
+
+    head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        int slot = (int)cqe->user_data;
+        aio_request *req = &aio_slots[slot];
+
+        ready_push(req->user_data, (cqe->res == req->nblocks * BLOCK_SIZE) ? req->nblocks : -1);
+        // The kernel moved it without a caller waiting on it: counted, but not timed
+        disk_stats_request(req->is_write, req->start_address, req->nblocks, 0);
+        aio_free_slots[aio_free_count++] = slot;
+        aio_inflight--;
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+#endif
+
+// -------------------------- Thread pool engine --------------------------------
+static void *aio_worker(void *arg) {
+    aio_request req;
+    int result;
+
+    pthread_mutex_lock(&aio_lock);
+    for (;;) {
+        while (aio_queue_count == 0 && !aio_stopping) pthread_cond_wait(&aio_work, &aio_lock);
+        if (aio_queue_count == 0) break;
+
+        req = aio_queue[aio_queue_head];
+        aio_queue_head = (aio_queue_head + 1) % aio_depth;
+        aio_queue_count--;
+        pthread_mutex_unlock(&aio_lock);
+
+        if (req.is_write) result = write_blocks(req.start_address, req.nblocks, req.buffer);
+        else result = read_blocks(req.start_address, req.nblocks, req.buffer);
+
+        pthread_mutex_lock(&aio_lock);
+        ready_push(req.user_data, result);
+        aio_inflight--;
+        pthread_cond_broadcast(&aio_done);
+    }
+    pthread_mutex_unlock(&aio_lock);
+    return NULL;
+}
+
+// ------------------------------- Setup ----------------------------------------
+
+static void aio_close();
+
+// disk_aio_init, called with aio_setup_lock held
+static int aio_open(int depth, int engine) {
+    int i;
+
+    if (aio_engine != -1) aio_close();
+    if (depth <= 0) depth = AIO_DEFAULT_DEPTH;
+    aio_requested = engine;
+    aio_fd = disk_direct_fd();
+    aio_depth = depth;
+    aio_inflight = 0;
+    aio_ready_count = 0;
+    aio_ready_size = depth;
+    aio_ready = malloc(depth * sizeof(disk_completion));
+
+#ifdef __linux__
+    if (engine != DISK_AIO_THREADS && disk_direct_fd() >= 0 && uring_setup(depth) == 0) {
+        aio_slots = malloc(depth * sizeof(aio_request));
+        aio_free_slots = malloc(depth * sizeof(int));
+        for (i = 0; i < depth; i++) aio_free_slots[i] = depth - 1 - i;
+        aio_free_count = depth;
+        aio_engine = DISK_AIO_URING;
+        return aio_engine;
+    }
+#endif
+    if (engine == DISK_AIO_URING) {
+        printf("io_uring is not available for this disk, using worker threads\n");
+    }
+
+    aio_queue = malloc(depth * sizeof(aio_request));
+    aio_queue_head = 0;
+    aio_queue_count = 0;
+    aio_stopping = 0;
+    for (i = 0; i < AIO_WORKERS; i++) {
+        pthread_create(&aio_threads[i], NULL, aio_worker, NULL);
+    }
+    aio_engine = DISK_AIO_THREADS;
+    return aio_engine;
+}
+
+// disk_aio_close, called with aio_setup_lock held
+static void aio_close() {
+    int i;
+
+    if (aio_engine == -1) return;
+#ifdef __linux__
+    if (aio_engine == DISK_AIO_URING) {
+        pthread_mutex_lock(&aio_lock);
+        while (aio_inflight > 0) {
+            aio_ready_count = 0;
+            uring_collect(1);
+        }
+        pthread_mutex_unlock(&aio_lock);
+        uring_teardown();
+        free(aio_slots);
+        free(aio_free_slots);
+    }
+#endif
+    if (aio_engine == DISK_AIO_THREADS) {
+        pthread_mutex_lock(&aio_lock);
+        aio_stopping = 1;
+        pthread_cond_broadcast(&aio_work);
+        pthread_mutex_unlock(&aio_lock);
+        for (i = 0; i < AIO_WORKERS; i++) pthread_join(aio_threads[i], NULL);
+        free(aio_queue);
+    }
+    free(aio_ready);
+    aio_engine = -1;
+}
+
+// Whether the engine was picked for another disk than the one open now (the
+// backend or the device model changed, or the image was reopened). Only an
+// idle queue is swapped: what is in flight or unreaped still belongs to it.
+static int aio_stale() {
+    int idle;
+
+    pthread_mutex_lock(&aio_lock);
+    idle = aio_inflight == 0 && aio_ready_count == 0;
+    pthread_mutex_unlock(&aio_lock);
+    return idle && disk_direct_fd() != aio_fd;
+}
+
+// ------------------------------- Public API -----------------------------------
+
+// Sets up the queue for at most depth requests in flight. engine is one of
+// DISK_AIO_AUTO, DISK_AIO_URING or DISK_AIO_THREADS.
+int disk_aio_init(int depth, int engine) {
+    int result;
+
+    pthread_mutex_lock(&aio_setup_lock);
+    result = aio_open(depth, engine);
+    pthread_mutex_unlock(&aio_setup_lock);
+    return result;
+}
+
+// Waits for everything in flight, then releases the queue. Completions that were
+// never reaped are dropped. close_disk() calls it, so the next request sets up an
+// engine for the disk opened after.
+int disk_aio_close() {
+    pthread_mutex_lock(&aio_setup_lock);
+    aio_close();
+    pthread_mutex_unlock(&aio_setup_lock);
+    return 0;
+}
+
+static int submit(int is_write, int start_address, int nblocks, void *buffer, void *user_data) {
+    aio_request req;
+
+    pthread_mutex_lock(&aio_setup_lock);
+    if (aio_engine == -1) aio_open(AIO_DEFAULT_DEPTH, DISK_AIO_AUTO);
+    else if (aio_stale()) aio_open(aio_depth, aio_requested);
+    pthread_mutex_unlock(&aio_setup_lock);
+
+    // Checks that the data requested is within the range of addresses of the disk
+    if (start_address < 0 || nblocks <= 0 || start_address + nblocks > MAX_BLOCK) {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+    req.is_write = is_write;
+    req.start_address = start_address;
+    req.nblocks = nblocks;
+    req.buffer = buffer;
+    req.user_data = user_data;
+
+#ifdef __linux__
+    if (aio_engine == DISK_AIO_URING) {
+        int slot, result = 0;
+
+        pthread_mutex_lock(&aio_lock);
+        // Queue full: park one completion on the ready list to free a slot
+        while (aio_free_count == 0) uring_collect(1);
+        slot = aio_free_slots[--aio_free_count];
+        aio_slots[slot] = req;
+        aio_inflight++;
+        if (uring_submit(slot) < 0) {
+            aio_inflight--;
+            aio_free_slots[aio_free_count++] = slot;
+            result = -1;
+        }
+        pthread_mutex_unlock(&aio_lock);
+        return result;
+    }
+#endif
+    pthread_mutex_lock(&aio_lock);
+    while (aio_inflight == aio_depth) pthread_cond_wait(&aio_done, &aio_lock);
+    aio_queue[(aio_queue_head + aio_queue_count) % aio_depth] = req;
+    aio_queue_count++;
+    aio_inflight++;
+    pthread_cond_signal(&aio_work);
+    pthread_mutex_unlock(&aio_lock);
+    return 0;
+}
+
+// Queues a read of nblocks starting at start_address into buffer. The buffer must
+// stay valid until the completion carrying user_data has been reaped.
+int disk_submit_read(int start_address, int nblocks, void *buffer, void *user_data) {
+    return submit(0, start_address, nblocks, buffer, user_data);
+}
+
+// Queues a write of nblocks from buffer, same lifetime rule as disk_submit_read
+int disk_submit_write(int start_address, int nblocks, void *buffer, void *user_data) {
+    return submit(1, start_address, nblocks, buffer, user_data);
+}
+
+// Returns between min_complete and max_complete completions in out, waiting for
+// the first min_complete. Waiting for more than is in flight returns early.
+int disk_reap(disk_completion *out, int min_complete, int max_complete) {
+    int n;
+
+    if (aio_engine == -1) return 0;
+#ifdef __linux__
+    if (aio_engine == DISK_AIO_URING) {
+        pthread_mutex_lock(&aio_lock);
+        uring_collect(0);
+        while (aio_ready_count < min_complete && aio_inflight > 0) uring_collect(1);
+        n = (aio_ready_count < max_complete) ? aio_ready_count : max_complete;
+        memcpy(out, aio_ready, n * sizeof(disk_completion));
+        memmove(aio_ready, aio_ready + n, (aio_ready_count - n) * sizeof(disk_completion));
+        aio_ready_count -= n;
+        pthread_mutex_unlock(&aio_lock);
+        return n;
+    }
+#endif
+    pthread_mutex_lock(&aio_lock);
+    while (aio_ready_count < min_complete && aio_inflight > 0) pthread_cond_wait(&aio_done, &aio_lock);
+    n = (aio_ready_count < max_complete) ? aio_ready_count : max_complete;
+    memcpy(out, aio_ready, n * sizeof(disk_completion));
+    memmove(aio_ready, aio_ready + n, (aio_ready_count - n) * sizeof(disk_completion));
+    aio_ready_count -= n;
+    pthread_mutex_unlock(&aio_lock);
+    return n;
+}
+
+// Number of requests submitted and not yet reaped
+int disk_aio_pending() {
+    int n;
+
+    pthread_mutex_lock(&aio_lock);
+    n = aio_inflight + aio_ready_count;
+    pthread_mutex_unlock(&aio_lock);
+    return n;
+}
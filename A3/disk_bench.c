@@ -0,0 +1,275 @@
+/* disk_bench.c
+ *
+ * Micro-benchmark for the disk emulator backends.
+ *
+ *   disk_bench io      replays the access pattern of the file system metadata
+ *                      flushes (runs of 7-16 blocks) plus single block data I/O
+ *                      against every backend and prints the time per call.
+ *   disk_bench format  times init_fresh_disk() plus the first superblock and
+ *                      bitmap writes for images from 4 MiB to 8 GiB.
+ *   disk_bench model   charges sequential and scattered 1 and 7-16 block
+ *                      writes to the HDD and SSD device models.
+ *   disk_bench aio     scattered single block writes, one write_blocks call
+ *                      at a time versus queued through disk_submit_write.
+ *   disk_bench stripe  large sequential transfers under the SSD model on one
+ *                      image versus striped over 2 and 4 member images.
+ *
+ * Without an argument io and format are run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "disk_emu.h"
+
+#define BENCH_DISK "bench.disk"
+#define BENCH_BLOCK_SIZE 1024
+#define BENCH_BLOCK_NUMBER 4096
+#define BENCH_ROUNDS 2000
+#define BENCH_MODEL_ROUNDS 200
+#define BENCH_AIO_BLOCKS 256
+#define BENCH_STRIPE_BLOCKS 256
+#define BENCH_STRIPE_ROUNDS 20
+
+static const char *backend_names[] = { "stdio", "pread", "mmap", "ram", "striped" };
+
+static double now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Runs the same pseudo-random sequence of nblocks-sized transfers for one
+ * backend and reports the average cost of a read and of a write call.
+ */
+static void bench_io(int backend, int min_blocks, int max_blocks)
+{
+  char *buffer = malloc(max_blocks * BENCH_BLOCK_SIZE);
+  double start, t_write, t_read;
+  int i;
+
+  memset(buffer, 0xAB, max_blocks * BENCH_BLOCK_SIZE);
+  disk_set_backend(backend);
+  init_fresh_disk(BENCH_DISK, BENCH_BLOCK_SIZE, BENCH_BLOCK_NUMBER);
+
+  srand(427);
+  start = now_us();
+  for (i = 0; i < BENCH_ROUNDS; i++) {
+    int n = min_blocks + rand() % (max_blocks - min_blocks + 1);
+    write_blocks(rand() % (BENCH_BLOCK_NUMBER - n), n, buffer);
+  }
+  disk_sync();
+  t_write = (now_us() - start) / BENCH_ROUNDS;
+
+  srand(427);
+  start = now_us();
+  for (i = 0; i < BENCH_ROUNDS; i++) {
+    int n = min_blocks + rand() % (max_blocks - min_blocks + 1);
+    read_blocks(rand() % (BENCH_BLOCK_NUMBER - n), n, buffer);
+  }
+  t_read = (now_us() - start) / BENCH_ROUNDS;
+
+  close_disk();
+  remove(BENCH_DISK);
+  free(buffer);
+
+  printf("%-8s %2d-%-2d blocks  write %9.2f us/call  read %9.2f us/call\n",
+         backend_names[backend], min_blocks, max_blocks, t_write, t_read);
+}
+
+/* Formats an image of the given size the way mksfs(1) does: fresh disk,
+ * then the superblock at the front and the bitmap at the end.
+ */
+static void bench_format(int backend, long long mib)
+{
+  int nblocks = (int)(mib * 1024 * 1024 / BENCH_BLOCK_SIZE);
+  char block[BENCH_BLOCK_SIZE];
+  double start, t_format;
+
+  memset(block, 0xCD, sizeof(block));
+  disk_set_backend(backend);
+
+  start = now_us();
+  if (init_fresh_disk(BENCH_DISK, BENCH_BLOCK_SIZE, nblocks) < 0) {
+    printf("%-8s %6lld MiB  could not format\n", backend_names[backend], mib);
+    return;
+  }
+  write_blocks(0, 1, block);
+  write_blocks(nblocks - 1, 1, block);
+  disk_sync();
+  t_format = now_us() - start;
+
+  close_disk();
+  remove(BENCH_DISK);
+
+  printf("%-8s %6lld MiB  format %10.1f us\n", backend_names[backend], mib, t_format);
+}
+
+/* Reports the modelled device time per call for a sequential and a scattered
+ * stream of writes. The sleeps are real, so keep the number of calls small.
+ */
+static void bench_model(const disk_profile *profile, int min_blocks, int max_blocks)
+{
+  char *buffer = malloc(max_blocks * BENCH_BLOCK_SIZE);
+  double t_seq, t_rand;
+  int i, next = 0;
+
+  memset(buffer, 0xEF, max_blocks * BENCH_BLOCK_SIZE);
+  disk_set_backend(DISK_BACKEND_PREAD);
+  disk_set_profile(profile);
+  init_fresh_disk(BENCH_DISK, BENCH_BLOCK_SIZE, BENCH_BLOCK_NUMBER);
+
+  srand(427);
+  for (i = 0; i < BENCH_MODEL_ROUNDS; i++) {
+    int n = min_blocks + rand() % (max_blocks - min_blocks + 1);
+    if (next + n > BENCH_BLOCK_NUMBER) next = 0;
+    write_blocks(next, n, buffer);
+    next += n;
+  }
+  t_seq = disk_busy_us() / BENCH_MODEL_ROUNDS;
+
+  init_fresh_disk(BENCH_DISK, BENCH_BLOCK_SIZE, BENCH_BLOCK_NUMBER);
+  for (i = 0; i < BENCH_MODEL_ROUNDS; i++) {
+    int n = min_blocks + rand() % (max_blocks - min_blocks + 1);
+    write_blocks(rand() % (BENCH_BLOCK_NUMBER - n), n, buffer);
+  }
+  t_rand = disk_busy_us() / BENCH_MODEL_ROUNDS;
+
+  close_disk();
+  remove(BENCH_DISK);
+  disk_set_profile(&DISK_PROFILE_IDEAL);
+  free(buffer);
+
+  printf("%-8s %2d-%-2d blocks  sequential %9.1f us/call  scattered %9.1f us/call\n",
+         profile->name, min_blocks, max_blocks, t_seq, t_rand);
+}
+
+/* Writes BENCH_AIO_BLOCKS scattered blocks synchronously, then again through the
+ * submission queue with everything in flight, under the given device model.
+ */
+static void bench_aio(const disk_profile *profile, int engine)
+{
+  static const char *engine_names[] = { "auto", "io_uring", "threads" };
+  char *buffer = malloc(BENCH_AIO_BLOCKS * BENCH_BLOCK_SIZE);
+  disk_completion done[BENCH_AIO_BLOCKS];
+  double start, t_sync, t_async;
+  int i, used;
+
+  memset(buffer, 0x5A, BENCH_AIO_BLOCKS * BENCH_BLOCK_SIZE);
+  disk_set_backend(DISK_BACKEND_PREAD);
+  disk_set_profile(profile);
+  init_fresh_disk(BENCH_DISK, BENCH_BLOCK_SIZE, BENCH_BLOCK_NUMBER);
+
+  srand(427);
+  start = now_us();
+  for (i = 0; i < BENCH_AIO_BLOCKS; i++) {
+    write_blocks(rand() % BENCH_BLOCK_NUMBER, 1, buffer + i * BENCH_BLOCK_SIZE);
+  }
+  t_sync = now_us() - start;
+
+  used = disk_aio_init(BENCH_AIO_BLOCKS, engine);
+  srand(427);
+  start = now_us();
+  for (i = 0; i < BENCH_AIO_BLOCKS; i++) {
+    disk_submit_write(rand() % BENCH_BLOCK_NUMBER, 1, buffer + i * BENCH_BLOCK_SIZE, NULL);
+  }
+  for (i = 0; i < BENCH_AIO_BLOCKS; i += disk_reap(done, 1, BENCH_AIO_BLOCKS));
+  t_async = now_us() - start;
+  disk_aio_close();
+
+  close_disk();
+  remove(BENCH_DISK);
+  disk_set_profile(&DISK_PROFILE_IDEAL);
+  free(buffer);
+
+  printf("%-8s %-8s %d blocks  sync %9.1f us  queued %9.1f us\n",
+         profile->name, engine_names[used], BENCH_AIO_BLOCKS, t_sync, t_async);
+}
+
+/* Reads and writes BENCH_STRIPE_BLOCKS blocks at a time, walking the whole
+ * disk, under the SSD model. members 1 is the plain pread backend; above that
+ * the transfer is split over the member images, each charged and moved by its
+ * own thread.
+ */
+static void bench_stripe(int members, int unit)
+{
+  char *buffer = malloc(BENCH_STRIPE_BLOCKS * BENCH_BLOCK_SIZE);
+  char name[64];
+  double start, t_write, t_read;
+  int i;
+
+  memset(buffer, 0x3C, BENCH_STRIPE_BLOCKS * BENCH_BLOCK_SIZE);
+  disk_set_backend(members > 1 ? DISK_BACKEND_STRIPED : DISK_BACKEND_PREAD);
+  disk_set_stripe(members, unit);
+  disk_set_profile(&DISK_PROFILE_SSD);
+  init_fresh_disk(BENCH_DISK, BENCH_BLOCK_SIZE, BENCH_BLOCK_NUMBER);
+
+  start = now_us();
+  for (i = 0; i < BENCH_STRIPE_ROUNDS; i++) {
+    write_blocks((i * BENCH_STRIPE_BLOCKS) % BENCH_BLOCK_NUMBER, BENCH_STRIPE_BLOCKS, buffer);
+  }
+  t_write = (now_us() - start) / BENCH_STRIPE_ROUNDS;
+
+  start = now_us();
+  for (i = 0; i < BENCH_STRIPE_ROUNDS; i++) {
+    read_blocks((i * BENCH_STRIPE_BLOCKS) % BENCH_BLOCK_NUMBER, BENCH_STRIPE_BLOCKS, buffer);
+  }
+  t_read = (now_us() - start) / BENCH_STRIPE_ROUNDS;
+
+  close_disk();
+  remove(BENCH_DISK);
+  for (i = 0; i < members; i++) {
+    snprintf(name, sizeof(name), "%s.%d", BENCH_DISK, i);
+    remove(name);
+  }
+  disk_set_profile(&DISK_PROFILE_IDEAL);
+  free(buffer);
+
+  printf("%d x %-3d blocks  %d block transfers  write %9.1f us/call  read %9.1f us/call\n",
+         members, unit, BENCH_STRIPE_BLOCKS, t_write, t_read);
+}
+
+int main(int argc, char **argv)
+{
+  static const long long sizes_mib[] = { 4, 64, 1024, 4096, 8192 };
+  int run_io = (argc < 2 || strcmp(argv[1], "io") == 0);
+  int run_format = (argc < 2 || strcmp(argv[1], "format") == 0);
+  int run_model = (argc >= 2 && strcmp(argv[1], "model") == 0);
+  int run_aio = (argc >= 2 && strcmp(argv[1], "aio") == 0);
+  int run_stripe = (argc >= 2 && strcmp(argv[1], "stripe") == 0);
+  int b, i;
+
+  if (run_io) {
+    for (b = DISK_BACKEND_STDIO; b <= DISK_BACKEND_RAM; b++) {
+      bench_io(b, 1, 1);
+      bench_io(b, 7, 16);
+    }
+  }
+  if (run_format) {
+    for (b = DISK_BACKEND_STDIO; b <= DISK_BACKEND_MMAP; b++) {
+      for (i = 0; i < sizeof(sizes_mib) / sizeof(sizes_mib[0]); i++) {
+        bench_format(b, sizes_mib[i]);
+      }
+    }
+  }
+  if (run_model) {
+    bench_model(&DISK_PROFILE_HDD, 1, 1);
+    bench_model(&DISK_PROFILE_HDD, 7, 16);
+    bench_model(&DISK_PROFILE_SSD, 1, 1);
+    bench_model(&DISK_PROFILE_SSD, 7, 16);
+  }
+  if (run_aio) {
+    bench_aio(&DISK_PROFILE_IDEAL, DISK_AIO_URING);
+    bench_aio(&DISK_PROFILE_IDEAL, DISK_AIO_THREADS);
+    bench_aio(&DISK_PROFILE_SSD, DISK_AIO_THREADS);
+  }
+  if (run_stripe) {
+    bench_stripe(1, 16);
+    bench_stripe(2, 16);
+    bench_stripe(4, 16);
+    bench_stripe(4, 64);
+  }
+  return 0;
+}
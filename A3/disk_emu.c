@@ -1,24 +1,561 @@
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
 
 FILE* fp = NULL;
-double L, p;
-double r;
+static int fd = -1;
+static char *image = NULL;        /*memory the mmap and ram backends move blocks through*/
+static size_t image_size = 0;
+static int backend = DISK_BACKEND_PREAD;
+#define IOV_BATCH 64  /*iovecs handed to one preadv/pwritev*/
+#define SCHED_MAX_QUEUE 256   /*queued blocks that force a dispatch*/
+#define SCHED_DEADLINE_MS 50  /*age of the oldest queued write that forces a dispatch*/
 int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
 
+/*read_blocks/write_blocks may be called from the async workers: this*/
+/*guards the stdio file position and the device model state          */
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Device model: the profile in use, the one disk_set_profile() picked  */
+/*for the next init, where the head was left by the last request and  */
+/*the total device time charged so far                                */
+const disk_profile DISK_PROFILE_IDEAL = { "ideal", 0, 0, 0, 0, 0, 0 };
+const disk_profile DISK_PROFILE_HDD = { "hdd", 4170, 4170, 2.0, 8000, 150, 150 };
+const disk_profile DISK_PROFILE_SSD = { "ssd", 90, 30, 0, 0, 520, 480 };
+static disk_profile profile = { "ideal", 0, 0, 0, 0, 0, 0 };
+static disk_profile next_profile = { "ideal", 0, 0, 0, 0, 0, 0 };
+static int head = 0;
+static double busy_us = 0;
+
+/*RAM disk: the buffer outlives close_disk() so the same disk can be   */
+/*mounted again in this process; optionally saved to its image file   */
+static char *ram = NULL;
+static char *ram_dirty = NULL;    /*one flag per block written since the last save*/
+static size_t ram_size = 0;
+static char ram_name[256];
+static int ram_persist = 0;
+static int ram_truncate = 0;      /*a fresh RAM disk replaces the whole image file*/
+
+/*Striped backend geometry used by the next init_*disk() call*/
+static int stripe_members = 4;
+static int stripe_unit = 16;      /*blocks per stripe*/
+static int member_head[DISK_STRIPE_MAX_MEMBERS];  /*each member image is a device of its own*/
+
+/*Write scheduler: while plugged, writes are parked one block per slot*/
+/*and dispatched in elevator order when unplugged or when a deadline  */
+/*or the queue size is hit                                            */
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int plug_depth = 0;       /*plugs are per thread*/
+static __thread unsigned plug_failures;   /*sched_failures at this thread's outermost plug*/
+static unsigned sched_failures = 0;       /*queued writes that failed to dispatch, ever*/
+static unsigned synced_failures = 0;      /*sched_failures already reported by disk_sync*/
+static int *pending_slot = NULL;           /*block number -> slot, -1 if not queued*/
+static int pending_blocks[SCHED_MAX_QUEUE];
+static char *pending_data = NULL;          /*SCHED_MAX_QUEUE blocks*/
+static int pending_count = 0;
+static struct timespec pending_since;      /*when the oldest queued write arrived*/
+static int sched_deadline_ms = SCHED_DEADLINE_MS;
+
+/*I/O statistics, and when they were last dumped by the periodic dump*/
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static disk_stats stats;
+static int stats_next_block = -1;          /*block after the previous device request*/
+static int stats_interval_ms = 0;          /*0 turns the periodic dump off*/
+static struct timespec stats_dumped;
+
+static int sched_dispatch_locked();
+static int sched_dispatch();
+static void sort_iovec(block_iovec *vec, int count);
+static int transfer_run(int is_write, block_iovec *vec, int n);
+
+/*----------------------------------------------------------*/
+/*Selects the I/O backend used by the next init_*disk() call */
+/*----------------------------------------------------------*/
+int disk_set_backend(int new_backend)
+{
+    if (new_backend < DISK_BACKEND_STDIO || new_backend > DISK_BACKEND_STRIPED)
+    {
+        printf("Unknown disk backend %d\n", new_backend);
+        return -1;
+    }
+    backend = new_backend;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Sets the number of member images and the stripe unit, in   */
+/*blocks, of the striped backend for the next init_*disk()   */
+/*----------------------------------------------------------*/
+int disk_set_stripe(int members, int stripe_blocks)
+{
+    if (members < 1 || members > DISK_STRIPE_MAX_MEMBERS || stripe_blocks < 1)
+    {
+        printf("Invalid stripe geometry %d x %d blocks\n", members, stripe_blocks);
+        return -1;
+    }
+    stripe_members = members;
+    stripe_unit = stripe_blocks;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Selects the device model charged by every read and write   */
+/*from the next init_*disk() call on                         */
+/*----------------------------------------------------------*/
+int disk_set_profile(const disk_profile *new_profile)
+{
+    if (new_profile == NULL)
+    {
+        return -1;
+    }
+    next_profile = *new_profile;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Total device time charged by the model since init, in us   */
+/*----------------------------------------------------------*/
+double disk_busy_us()
+{
+    return busy_us;
+}
+
+/*----------------------------------------------------------*/
+/*Monotonic clock in microseconds                            */
+/*----------------------------------------------------------*/
+static double now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*----------------------------------------------------------*/
+/*Copies out the statistics gathered so far                  */
+/*----------------------------------------------------------*/
+void disk_get_stats(disk_stats *out)
+{
+    pthread_mutex_lock(&stats_lock);
+    *out = stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void disk_reset_stats()
+{
+    pthread_mutex_lock(&stats_lock);
+    memset(&stats, 0, sizeof(stats));
+    stats_next_block = -1;
+    clock_gettime(CLOCK_MONOTONIC, &stats_dumped);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*----------------------------------------------------------*/
+/*Prints the statistics to stderr, tagged with label         */
+/*----------------------------------------------------------*/
+static void dump_stats(const char *label, const disk_stats *st)
+{
+    fprintf(stderr, "disk %s: read %lld calls %lld requests %lld blocks %lld bytes %.0f us, "
+            "write %lld calls %lld requests %lld blocks %lld bytes %.0f us, %lld sequential %lld random\n",
+            label, st->read_calls, st->read_requests, st->blocks_read, st->bytes_read, st->read_us,
+            st->write_calls, st->write_requests, st->blocks_written, st->bytes_written, st->write_us,
+            st->sequential, st->random);
+}
+
+void disk_dump_stats(const char *label)
+{
+    disk_stats st;
+
+    disk_get_stats(&st);
+    dump_stats(label, &st);
+}
+
+/*----------------------------------------------------------*/
+/*Dumps the statistics every interval_ms while I/O goes on;  */
+/*0 turns the dump off                                       */
+/*----------------------------------------------------------*/
+void disk_set_stats_interval(int interval_ms)
+{
+    stats_interval_ms = interval_ms;
+}
+
+/*----------------------------------------------------------*/
+/*Counts one read_blocks/write_blocks(_v) call               */
+/*----------------------------------------------------------*/
+static void stats_call(int is_write)
+{
+    pthread_mutex_lock(&stats_lock);
+    if (is_write) stats.write_calls++;
+    else stats.read_calls++;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Counts one request that reached the device and the time it took.  */
+/*Also called by disk_aio.c for requests the ring sends past us.    */
+/*------------------------------------------------------------------*/
+void disk_stats_request(int is_write, int start_address, int nblocks, double us)
+{
+    disk_stats st;
+    struct timespec now;
+    int dump = 0;
+
+    pthread_mutex_lock(&stats_lock);
+    if (is_write)
+    {
+        stats.write_requests++;
+        stats.blocks_written += nblocks;
+        stats.bytes_written += (long long)nblocks * BLOCK_SIZE;
+        stats.write_us += us;
+    }
+    else
+    {
+        stats.read_requests++;
+        stats.blocks_read += nblocks;
+        stats.bytes_read += (long long)nblocks * BLOCK_SIZE;
+        stats.read_us += us;
+    }
+    if (start_address == stats_next_block) stats.sequential++;
+    else stats.random++;
+    stats_next_block = start_address + nblocks;
+
+    if (stats_interval_ms > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - stats_dumped.tv_sec) * 1000 + (now.tv_nsec - stats_dumped.tv_nsec) / 1000000 >= stats_interval_ms)
+        {
+            stats_dumped = now;
+            st = stats;
+            dump = 1;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    if (dump) dump_stats("stats", &st);
+}
+
+/*----------------------------------------------------------*/
+/*Installs the device model picked by disk_set_profile();    */
+/*DISK_EMU_PROFILE=ideal|hdd|ssd overrides the device model, */
+/*DISK_EMU_STATS=ms turns on the periodic statistics dump    */
+/*----------------------------------------------------------*/
+static void profile_from_env()
+{
+    char *name = getenv("DISK_EMU_PROFILE");
+
+    profile = next_profile;
+    if (getenv("DISK_EMU_STATS") != NULL) stats_interval_ms = atoi(getenv("DISK_EMU_STATS"));
+
+    if (name == NULL) return;
+    if (strcmp(name, "ideal") == 0) profile = DISK_PROFILE_IDEAL;
+    else if (strcmp(name, "hdd") == 0) profile = DISK_PROFILE_HDD;
+    else if (strcmp(name, "ssd") == 0) profile = DISK_PROFILE_SSD;
+    else printf("Unknown DISK_EMU_PROFILE %s, keeping profile %s\n", name, profile.name);
+}
+
+/*------------------------------------------------------------------*/
+/*Charges one request to the device model and stalls for its cost:  */
+/*fixed latency, seek proportional to the distance from the last    */
+/*request (capped at a full stroke) and transfer time at bandwidth. */
+/*1 MB/s moves one byte per microsecond. pos is the head to move.   */
+/*------------------------------------------------------------------*/
+static void model_charge(int *pos, int is_write, int start_address, int nblocks)
+{
+    double latency = is_write ? profile.write_latency_us : profile.read_latency_us;
+    double bandwidth = is_write ? profile.write_mb_per_s : profile.read_mb_per_s;
+    double seek, cost;
+    struct timespec ts;
+
+    pthread_mutex_lock(&io_lock);
+    seek = profile.seek_us_per_block * abs(start_address - *pos);
+    if (profile.max_seek_us > 0 && seek > profile.max_seek_us) seek = profile.max_seek_us;
+    cost = latency + seek;
+    if (bandwidth > 0) cost += (double)nblocks * BLOCK_SIZE / bandwidth;
+    *pos = start_address + nblocks;
+    if (cost > 0) busy_us += cost;
+    pthread_mutex_unlock(&io_lock);
+
+    /*The stall happens outside the lock so queued requests overlap*/
+    if (cost <= 0) return;
+    ts.tv_sec = (time_t)(cost / 1e6);
+    ts.tv_nsec = (long)((cost - ts.tv_sec * 1e6) * 1e3);
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+/*------------------------------------------------------------------*/
+/*Charges a request on the logical disk. The striped backend only    */
+/*moves the logical head here: its members charge their own share.   */
+/*------------------------------------------------------------------*/
+static void model_request(int is_write, int start_address, int nblocks)
+{
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        pthread_mutex_lock(&io_lock);
+        head = start_address + nblocks;
+        pthread_mutex_unlock(&io_lock);
+        return;
+    }
+    model_charge(&head, is_write, start_address, nblocks);
+}
+
+/*------------------------------------------------------------------*/
+/*Charges a request on one member image of the striped backend, from */
+/*the member thread that moves it, so the members' costs overlap     */
+/*------------------------------------------------------------------*/
+void disk_model_member(int member, int is_write, int member_block, int nblocks)
+{
+    model_charge(&member_head[member], is_write, member_block, nblocks);
+}
+
+/*----------------------------------------------------------*/
+/*Descriptor the async queue may hand to the kernel directly:*/
+/*only the pread backend with a free device model qualifies, */
+/*anything else has to go through read_blocks/write_blocks.  */
+/*----------------------------------------------------------*/
+int disk_direct_fd()
+{
+    if (backend != DISK_BACKEND_PREAD) return -1;
+    if (profile.read_latency_us > 0 || profile.write_latency_us > 0 || profile.seek_us_per_block > 0 ||
+        profile.read_mb_per_s > 0 || profile.write_mb_per_s > 0) return -1;
+    return fd;
+}
+
+/*----------------------------------------------------------*/
+/*DISK_EMU_BACKEND=stdio|pread|mmap|ram|striped overrides   */
+/*the selection, DISK_EMU_STRIPE=members:unit the geometry   */
+/*----------------------------------------------------------*/
+static void backend_from_env()
+{
+    char *name = getenv("DISK_EMU_BACKEND");
+
+    if (name == NULL) return;
+    if (strcmp(name, "stdio") == 0) backend = DISK_BACKEND_STDIO;
+    else if (strcmp(name, "pread") == 0) backend = DISK_BACKEND_PREAD;
+    else if (strcmp(name, "mmap") == 0) backend = DISK_BACKEND_MMAP;
+    else if (strcmp(name, "ram") == 0) backend = DISK_BACKEND_RAM;
+    else if (strcmp(name, "striped") == 0) backend = DISK_BACKEND_STRIPED;
+    else printf("Unknown DISK_EMU_BACKEND %s, keeping backend %d\n", name, backend);
+
+    if (getenv("DISK_EMU_RAM_SAVE") != NULL) ram_persist = atoi(getenv("DISK_EMU_RAM_SAVE"));
+    if (getenv("DISK_EMU_STRIPE") != NULL)
+    {
+        int members, unit;
+        if (sscanf(getenv("DISK_EMU_STRIPE"), "%d:%d", &members, &unit) != 2 || disk_set_stripe(members, unit) < 0)
+        {
+            printf("Bad DISK_EMU_STRIPE %s, keeping %d:%d\n", getenv("DISK_EMU_STRIPE"), stripe_members, stripe_unit);
+        }
+    }
+}
+
+/*----------------------------------------------------------*/
+/*Whether the ram backend writes itself back to its image    */
+/*file on disk_sync() and close_disk()                       */
+/*----------------------------------------------------------*/
+void disk_set_ram_persist(int persist)
+{
+    ram_persist = persist;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes the blocks changed since the last save to the image file    */
+/*------------------------------------------------------------------*/
+static int ram_save()
+{
+    int out, i, run;
+
+    if (ram == NULL || !ram_persist) return 0;
+
+    out = open(ram_name, O_RDWR | O_CREAT, 0644);
+    if (out < 0)
+    {
+        printf("Could not save RAM disk to %s\n", ram_name);
+        return -1;
+    }
+    if (ram_truncate && ftruncate(out, 0) < 0) printf("Could not truncate %s\n", ram_name);
+    if (ftruncate(out, ram_size) < 0) printf("Could not size %s\n", ram_name);
+    ram_truncate = 0;
+
+    for (i = 0; i < MAX_BLOCK; i += run)
+    {
+        for (run = 1; i + run < MAX_BLOCK && ram_dirty[i + run] == ram_dirty[i]; run++);
+        if (!ram_dirty[i]) continue;
+        if (pwrite(out, ram + (size_t)i * BLOCK_SIZE, (size_t)run * BLOCK_SIZE, (off_t)i * BLOCK_SIZE) < 0)
+        {
+            printf("Could not save RAM disk to %s\n", ram_name);
+            close(out);
+            return -1;
+        }
+        memset(ram_dirty + i, 0, run);
+    }
+    fsync(out);
+    close(out);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Attaches the ram backend. Mounting the RAM disk that is already in */
+/*memory keeps its contents; otherwise it is loaded from the image   */
+/*file, or starts zeroed for a fresh disk.                           */
+/*------------------------------------------------------------------*/
+static int ram_attach(char *filename, int fresh)
+{
+    size_t size = (size_t)MAX_BLOCK * BLOCK_SIZE;
+    FILE *in;
+
+    if (!fresh && ram != NULL && ram_size == size && strcmp(ram_name, filename) == 0)
+    {
+        image = ram;
+        image_size = size;
+        return 0;
+    }
+
+    free(ram);
+    free(ram_dirty);
+    ram = calloc(1, size);
+    ram_dirty = calloc(MAX_BLOCK, 1);
+    ram_size = size;
+    strncpy(ram_name, filename, sizeof(ram_name) - 1);
+    ram_truncate = fresh;
+
+    if (!fresh)
+    {
+        in = fopen(filename, "rb");
+        if (in == NULL)
+        {
+            printf("Could not open %s\n\n", filename);
+            free(ram);
+            free(ram_dirty);
+            ram = NULL;
+            ram_dirty = NULL;
+            return -1;
+        }
+        if (fread(ram, 1, size, in) < size) printf("Image %s is short, the rest reads as 0's\n", filename);
+        fclose(in);
+    }
+    image = ram;
+    image_size = size;
+    return 0;
+}
+
+/*----------------------------------------------------------*/
+/*Pushes everything written so far down to the image file    */
+/*----------------------------------------------------------*/
+int disk_sync()
+{
+    int failed;
+
+    /*Like fsync, a parked write that failed since the last sync is reported once*/
+    pthread_mutex_lock(&sched_lock);
+    sched_dispatch_locked();
+    failed = sched_failures != synced_failures;
+    synced_failures = sched_failures;
+    pthread_mutex_unlock(&sched_lock);
+    if (failed) return -1;
+    if (backend == DISK_BACKEND_RAM)
+    {
+        return ram_save();
+    }
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        return stripe_sync();
+    }
+    if (image != NULL)
+    {
+        return msync(image, image_size, MS_SYNC);
+    }
+    if (fd >= 0)
+    {
+        return fsync(fd);
+    }
+    if (fp != NULL)
+    {
+        return fflush(fp);
+    }
+    return 0;
+}
+
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
+    /* The submission queue is tied to this disk: its requests finish first */
+    disk_aio_close();
+    sched_dispatch();
+    plug_depth = 0;
+    free(pending_slot);
+    free(pending_data);
+    pending_slot = NULL;
+    pending_data = NULL;
+    if (NULL != image && image == ram)
+    {
+        ram_save();
+        image = NULL;
+    }
+    else if (NULL != image)
+    {
+        msync(image, image_size, MS_SYNC);
+        munmap(image, image_size);
+        image = NULL;
+    }
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
+    }
+    stripe_close();
+    if (stats_interval_ms > 0 && (stats.read_calls > 0 || stats.write_calls > 0))
+    {
+        disk_dump_stats("at close");
+    }
+    fd = -1;
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Hands the opened image over to the selected backend. The pread and */
+/*mmap backends only use the descriptor, stdio is never touched again*/
+/*------------------------------------------------------------------*/
+static int attach_backend()
+{
+    struct stat st;
+
+    if (backend == DISK_BACKEND_STDIO)
+    {
+        return 0;
+    }
+
+    fflush(fp);
+    fd = fileno(fp);
+
+    if (backend == DISK_BACKEND_MMAP)
+    {
+        image_size = (size_t)MAX_BLOCK * BLOCK_SIZE;
+
+        /*A short image would SIGBUS on access past its end, grow it first*/
+        if (fstat(fd, &st) < 0 || (st.st_size < (off_t)image_size && ftruncate(fd, image_size) < 0))
+        {
+            printf("Could not size disk image for mmap\n");
+            return -1;
+        }
+        image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (image == MAP_FAILED)
+        {
+            printf("Could not mmap disk image\n");
+            image = NULL;
+            return -1;
+        }
     }
     return 0;
 }
@@ -28,13 +565,27 @@ int close_disk()
 /*---------------------------------------*/
 int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
-    int i, j;
-
+    close_disk();
+    backend_from_env();
+    profile_from_env();
+    head = 0;
+    memset(member_head, 0, sizeof(member_head));
+    busy_us = 0;
+    disk_reset_stats();
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
+
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
+
+    if (backend == DISK_BACKEND_RAM)
+    {
+        return ram_attach(filename, 1);
+    }
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        return stripe_open(filename, 1, stripe_members, stripe_unit);
+    }
     /*Creates a new file*/
     fp = fopen (filename, "w+b");
 
@@ -43,25 +594,42 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+
+    /*Sizes the file as one hole: unwritten blocks read back as 0's, so*/
+    /*formatting costs the same for any disk size and never writes data*/
+    if (ftruncate(fileno(fp), (off_t)MAX_BLOCK * BLOCK_SIZE) < 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not size new disk file %s\n\n", filename);
+        fclose(fp);
+        fp = NULL;
+        return -1;
     }
-    return 0;
+    return attach_backend();
 }
 /*----------------------------*/
 /*Initializes an existing disk*/
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
+    close_disk();
+    backend_from_env();
+    profile_from_env();
+    head = 0;
+    memset(member_head, 0, sizeof(member_head));
+    busy_us = 0;
+    disk_reset_stats();
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
+
+    if (backend == DISK_BACKEND_RAM)
+    {
+        return ram_attach(filename, 0);
+    }
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        return stripe_open(filename, 0, stripe_members, stripe_unit);
+    }
+
     /*Opens a file*/
     fp = fopen (filename, "r+b");
 
@@ -70,74 +638,605 @@ int init_disk(char *filename, int block_size, int num_blocks)
         printf("Could not open %s\n\n", filename);
         return -1;
     }
-    return 0;
+    return attach_backend();
 }
 
 /*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
+/*Reads the first length bytes of an image without attaching it, so  */
+/*a file system can read its geometry before calling init_disk()     */
 /*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+int disk_read_label(char *filename, void *buffer, int length)
+{
+    char name[512];
+    int in;
+    ssize_t n;
+
+    backend_from_env();
+    /*Writes still parked or buffered for the attached image go first*/
+    sched_dispatch();
+    if (fp != NULL) fflush(fp);
+
+    if (backend == DISK_BACKEND_RAM && ram != NULL && strcmp(ram_name, filename) == 0)
+    {
+        memcpy(buffer, ram, (size_t)length < ram_size ? (size_t)length : ram_size);
+        return length;
+    }
+
+    /*Block 0 of a striped disk is at the front of member 0*/
+    snprintf(name, sizeof(name), (backend == DISK_BACKEND_STRIPED) ? "%s.0" : "%s", filename);
+    in = open(name, O_RDONLY);
+    if (in < 0)
+    {
+        printf("Could not open %s\n\n", name);
+        return -1;
+    }
+    n = pread(in, buffer, length, 0);
+    close(in);
+    return (n == length) ? length : -1;
+}
+
+/*-------------------------------------------------------------------*/
+/*pread/pwrite the whole range in one call, retrying on short counts */
+/*-------------------------------------------------------------------*/
+static int pread_range(int start_address, int nblocks, void *buffer)
+{
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    off_t off = (off_t)start_address * BLOCK_SIZE;
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t n = pread(fd, (char *)buffer + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            printf("pread error at block %d\n", start_address);
+            return -1;
+        }
+        done += n;
+    }
+    return nblocks;
+}
+
+static int pwrite_range(int start_address, int nblocks, void *buffer)
+{
+    size_t len = (size_t)nblocks * BLOCK_SIZE;
+    off_t off = (off_t)start_address * BLOCK_SIZE;
+    size_t done = 0;
+
+    while (done < len)
+    {
+        ssize_t n = pwrite(fd, (char *)buffer + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0)
+        {
+            printf("pwrite error at block %d\n", start_address);
+            return -1;
+        }
+        done += n;
+    }
+    return nblocks;
+}
+
+/*------------------------------------------------------------------*/
+/*Dispatches every queued write, in one sweep: blocks from the head  */
+/*position upwards, then wrapping around to the lowest block (C-SCAN)*/
+/*Runs of adjacent blocks go out as single requests.                 */
+/*------------------------------------------------------------------*/
+static int sched_dispatch_locked()
+{
+    block_iovec vec[SCHED_MAX_QUEUE];
+    int i, run, first, start, n = pending_count, s = 0;
+
+    if (n == 0) return 0;
+    pthread_mutex_lock(&io_lock);
+    start = head;
+    pthread_mutex_unlock(&io_lock);
+    for (i = 0; i < n; i++)
+    {
+        vec[i].block = pending_blocks[i];
+        vec[i].buffer = pending_data + (size_t)i * BLOCK_SIZE;
+    }
+    sort_iovec(vec, n);
+
+    for (first = 0; first < n && vec[first].block < start; first++);
+    for (i = first; i < n; i += run)
+    {
+        for (run = 1; i + run < n && vec[i + run].block == vec[i + run - 1].block + 1; run++);
+        if (transfer_run(1, vec + i, run) < 0) s = -1;
+    }
+    for (i = 0; i < first; i += run)
+    {
+        for (run = 1; i + run < first && vec[i + run].block == vec[i + run - 1].block + 1; run++);
+        if (transfer_run(1, vec + i, run) < 0) s = -1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        pending_slot[pending_blocks[i]] = -1;
+    }
+    pending_count = 0;
+
+    /*The writes may belong to any plugged thread: each unplug checks the count*/
+    if (s < 0) sched_failures++;
+    return s;
+}
+
+static int sched_dispatch()
+{
+    int s;
+
+    pthread_mutex_lock(&sched_lock);
+    s = sched_dispatch_locked();
+    pthread_mutex_unlock(&sched_lock);
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Parks one block write. A block already queued is overwritten in    */
+/*place, so repeated writes of the same block reach the device once. */
+/*Called with sched_lock held. Returns -1 if making room failed.    */
+/*------------------------------------------------------------------*/
+static int sched_queue_locked(int block, void *buffer)
+{
+    int slot, s = 0;
+
+    if (pending_slot == NULL)
+    {
+        pending_slot = malloc(MAX_BLOCK * sizeof(int));
+        pending_data = malloc((size_t)SCHED_MAX_QUEUE * BLOCK_SIZE);
+        for (slot = 0; slot < MAX_BLOCK; slot++) pending_slot[slot] = -1;
+    }
+
+    slot = pending_slot[block];
+    if (slot == -1)
+    {
+        if (pending_count == SCHED_MAX_QUEUE) s = sched_dispatch_locked();
+        if (pending_count == 0) clock_gettime(CLOCK_MONOTONIC, &pending_since);
+        slot = pending_count++;
+        pending_blocks[slot] = block;
+        pending_slot[block] = slot;
+    }
+    memcpy(pending_data + (size_t)slot * BLOCK_SIZE, buffer, BLOCK_SIZE);
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Drops the queued write of one block. Called with sched_lock held.  */
+/*------------------------------------------------------------------*/
+static void sched_cancel_locked(int block)
+{
+    int slot = pending_count > 0 ? pending_slot[block] : -1;
+    int last;
+
+    if (slot == -1) return;
+    /*The last queued write moves into the freed slot*/
+    last = --pending_count;
+    if (slot != last)
+    {
+        pending_blocks[slot] = pending_blocks[last];
+        pending_slot[pending_blocks[slot]] = slot;
+        memcpy(pending_data + (size_t)slot * BLOCK_SIZE, pending_data + (size_t)last * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    pending_slot[block] = -1;
+}
+
+/*------------------------------------------------------------------*/
+/*Returns 1 with sched_lock held if this thread parks its writes,    */
+/*else 0. An unplugged write goes straight to the device, so the     */
+/*caller drops the queued copies of its blocks first (another        */
+/*thread's, now stale) or they would land over it later.             */
+/*------------------------------------------------------------------*/
+static int sched_lock_if_plugged()
+{
+    if (plug_depth == 0) return 0;
+    pthread_mutex_lock(&sched_lock);
+    return 1;
+}
+
+/*------------------------------------------------------------------*/
+/*Deadline, checked after each queued request: nothing waits in the  */
+/*queue for longer than sched_deadline_ms. 0 dispatches every request*/
+/*as it arrives, which turns the scheduler off.                      */
+/*------------------------------------------------------------------*/
+static int sched_check_deadline()
+{
+    struct timespec now;
+    int s = 0;
+
+    pthread_mutex_lock(&sched_lock);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (pending_count > 0 &&
+        (now.tv_sec - pending_since.tv_sec) * 1000 + (now.tv_nsec - pending_since.tv_nsec) / 1000000 >= sched_deadline_ms)
+    {
+        s = sched_dispatch_locked();
+    }
+    pthread_mutex_unlock(&sched_lock);
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Copies the queued version of each block over what was read, if any */
+/*------------------------------------------------------------------*/
+static void sched_overlay(const block_iovec *vec, int count)
+{
+    int i;
+
+    pthread_mutex_lock(&sched_lock);
+    for (i = 0; pending_count > 0 && i < count; i++)
+    {
+        if (pending_slot[vec[i].block] != -1)
+        {
+            memcpy(vec[i].buffer, pending_data + (size_t)pending_slot[vec[i].block] * BLOCK_SIZE, BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Starts queueing the writes of the calling thread. Plugs nest; the  */
+/*outermost unplug dispatches the queue and returns -1 if any queued */
+/*write failed since the outermost plug, whoever dispatched it: the  */
+/*queue is shared, so a failure of another thread's write shows too. */
+/*Requests from the async queue are not held back by a plug.         */
+/*------------------------------------------------------------------*/
+void disk_plug()
+{
+    if (plug_depth++ > 0) return;
+    pthread_mutex_lock(&sched_lock);
+    plug_failures = sched_failures;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+int disk_unplug()
+{
+    int s = 0;
+
+    if (plug_depth == 0 || --plug_depth > 0) return 0;
+    pthread_mutex_lock(&sched_lock);
+    if (sched_dispatch_locked() < 0 || sched_failures != plug_failures) s = -1;
+    pthread_mutex_unlock(&sched_lock);
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Drops the queued writes of blocks [start_address, +nblocks), for   */
+/*blocks about to be overwritten some other way (the async queue):   */
+/*dispatched later, they would land over the newer data.             */
+/*------------------------------------------------------------------*/
+void disk_cancel_writes(int start_address, int nblocks)
+{
+    int block;
+
+    pthread_mutex_lock(&sched_lock);
+    for (block = start_address; pending_count > 0 && block < start_address + nblocks; block++)
+    {
+        sched_cancel_locked(block);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Sets how long a write may wait in the queue, in milliseconds       */
+/*------------------------------------------------------------------*/
+void disk_set_sched_deadline(int deadline_ms)
+{
+    sched_deadline_ms = deadline_ms;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the device itself                    */
+/*-------------------------------------------------------------------*/
+static int device_read(int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    model_request(0, start_address, nblocks);
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (image != NULL)
     {
-        printf("out of bound error %d\n", start_address);
-        return -1;
+        memcpy(buffer, image + (size_t)start_address * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+    if (backend == DISK_BACKEND_PREAD)
+    {
+        return pread_range(start_address, nblocks, buffer);
+    }
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        return stripe_io(0, start_address, nblocks, buffer, NULL);
     }
 
+    /*Sets up a temporary buffer*/
+    void* blockRead = (void*) malloc(BLOCK_SIZE);
+
     /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    pthread_mutex_lock(&io_lock);
+    fseeko(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
 
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
         s++;
         fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);
     }
+    pthread_mutex_unlock(&io_lock);
 
     free(blockRead);
     return s;
 }
 
 /*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
+/*Writes a series of blocks to the device itself                    */
 /*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+static int device_write(int start_address, int nblocks, void *buffer)
 {
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    model_request(1, start_address, nblocks);
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (image != NULL)
     {
-        printf("out of bound error\n");
-        return -1;
+        memcpy(image + (size_t)start_address * BLOCK_SIZE, buffer, (size_t)nblocks * BLOCK_SIZE);
+        if (image == ram) memset(ram_dirty + start_address, 1, nblocks);
+        return nblocks;
+    }
+    if (backend == DISK_BACKEND_PREAD)
+    {
+        return pwrite_range(start_address, nblocks, buffer);
+    }
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        return stripe_io(1, start_address, nblocks, buffer, NULL);
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+
+    /*Goto where the data is to be written on the disk*/
+    pthread_mutex_lock(&io_lock);
+    fseeko(fp, (off_t)start_address * BLOCK_SIZE, SEEK_SET);
 
-    /*For every block requested*/        
+    /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
         memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
 
         fwrite(blockWrite, BLOCK_SIZE, 1, fp);
         fflush(fp);
         s++;
     }
+    pthread_mutex_unlock(&io_lock);
     free(blockWrite);
     return s;
 }
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    int i, s;
+    double start;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error %d\n", start_address);
+        return -1;
+    }
+
+    stats_call(0);
+    start = now_us();
+    s = device_read(start_address, nblocks, buffer);
+    disk_stats_request(0, start_address, nblocks, now_us() - start);
+
+    /*Queued writes are newer than what the device holds*/
+    for (i = 0; s > 0 && i < nblocks; i++)
+    {
+        block_iovec one = { start_address + i, (char *)buffer + (size_t)i * BLOCK_SIZE };
+        sched_overlay(&one, 1);
+    }
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    int i, s;
+    double start;
+
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
+    {
+        printf("out of bound error\n");
+        return -1;
+    }
+
+    stats_call(1);
+    if (sched_lock_if_plugged())
+    {
+        for (i = 0, s = 0; i < nblocks; i++)
+        {
+            if (sched_queue_locked(start_address + i, (char *)buffer + (size_t)i * BLOCK_SIZE) < 0) s = -1;
+        }
+        pthread_mutex_unlock(&sched_lock);
+        if (sched_check_deadline() < 0) s = -1;
+        return s < 0 ? -1 : nblocks;
+    }
+    disk_cancel_writes(start_address, nblocks);
+    start = now_us();
+    s = device_write(start_address, nblocks, buffer);
+    disk_stats_request(1, start_address, nblocks, now_us() - start);
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Orders a block vector by block number. Insertion sort: the vectors */
+/*come from file block maps and are short and mostly sorted already  */
+/*------------------------------------------------------------------*/
+static void sort_iovec(block_iovec *vec, int count)
+{
+    int i, j;
+    block_iovec key;
+
+    for (i = 1; i < count; i++)
+    {
+        key = vec[i];
+        for (j = i - 1; j >= 0 && vec[j].block > key.block; j--)
+        {
+            vec[j + 1] = vec[j];
+        }
+        vec[j + 1] = key;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Moves one run of consecutive blocks as a single device request     */
+/*------------------------------------------------------------------*/
+static int device_run(int is_write, block_iovec *vec, int n)
+{
+    struct iovec iov[IOV_BATCH];
+    int i, j, chunk;
+
+    model_request(is_write, vec[0].block, n);
+
+    if (image != NULL)
+    {
+        for (i = 0; i < n; i++)
+        {
+            char *block = image + (size_t)vec[i].block * BLOCK_SIZE;
+            if (is_write) memcpy(block, vec[i].buffer, BLOCK_SIZE);
+            else memcpy(vec[i].buffer, block, BLOCK_SIZE);
+        }
+        if (is_write && image == ram) memset(ram_dirty + vec[0].block, 1, n);
+        return n;
+    }
+
+    if (backend == DISK_BACKEND_STRIPED)
+    {
+        return stripe_io(is_write, vec[0].block, n, NULL, vec);
+    }
+
+    if (backend == DISK_BACKEND_PREAD)
+    {
+        for (i = 0; i < n; i += chunk)
+        {
+            off_t off = (off_t)vec[i].block * BLOCK_SIZE;
+            ssize_t moved;
+
+            chunk = (n - i < IOV_BATCH) ? n - i : IOV_BATCH;
+            for (j = 0; j < chunk; j++)
+            {
+                iov[j].iov_base = vec[i + j].buffer;
+                iov[j].iov_len = BLOCK_SIZE;
+            }
+            moved = is_write ? pwritev(fd, iov, chunk, off) : preadv(fd, iov, chunk, off);
+
+            /*A short or interrupted transfer is finished block by block*/
+            if (moved != (ssize_t)chunk * BLOCK_SIZE)
+            {
+                for (j = 0; j < chunk; j++)
+                {
+                    int r = is_write ? pwrite_range(vec[i + j].block, 1, vec[i + j].buffer)
+                                     : pread_range(vec[i + j].block, 1, vec[i + j].buffer);
+                    if (r < 0) return -1;
+                }
+            }
+        }
+        return n;
+    }
+
+    pthread_mutex_lock(&io_lock);
+    fseeko(fp, (off_t)vec[0].block * BLOCK_SIZE, SEEK_SET);
+    for (i = 0; i < n; i++)
+    {
+        if (is_write) fwrite(vec[i].buffer, BLOCK_SIZE, 1, fp);
+        else fread(vec[i].buffer, BLOCK_SIZE, 1, fp);
+    }
+    if (is_write) fflush(fp);
+    pthread_mutex_unlock(&io_lock);
+    return n;
+}
+
+static int transfer_run(int is_write, block_iovec *vec, int n)
+{
+    double start = now_us();
+    int s = device_run(is_write, vec, n);
+
+    disk_stats_request(is_write, vec[0].block, n, now_us() - start);
+    return s;
+}
+
+static int blocks_v(int is_write, block_iovec *vec, int count)
+{
+    int i, run, s;
+
+    /*Checks that every block requested is within the range of addresses of the disk*/
+    for (i = 0; i < count; i++)
+    {
+        if (vec[i].block < 0 || vec[i].block >= MAX_BLOCK)
+        {
+            printf("out of bound error %d\n", vec[i].block);
+            return -1;
+        }
+    }
+
+    stats_call(is_write);
+    if (is_write && sched_lock_if_plugged())
+    {
+        for (i = 0, s = 0; i < count; i++)
+        {
+            if (sched_queue_locked(vec[i].block, vec[i].buffer) < 0) s = -1;
+        }
+        pthread_mutex_unlock(&sched_lock);
+        if (sched_check_deadline() < 0) s = -1;
+        return s < 0 ? -1 : count;
+    }
+    if (is_write)
+    {
+        pthread_mutex_lock(&sched_lock);
+        for (i = 0; pending_count > 0 && i < count; i++)
+        {
+            sched_cancel_locked(vec[i].block);
+        }
+        pthread_mutex_unlock(&sched_lock);
+    }
+
+    sort_iovec(vec, count);
+
+    /*Every maximal run of consecutive block numbers becomes one request*/
+    s = 0;
+    for (i = 0; i < count; i += run)
+    {
+        for (run = 1; i + run < count && vec[i + run].block == vec[i + run - 1].block + 1; run++);
+        if (transfer_run(is_write, vec + i, run) < 0) return -1;
+        s += run;
+    }
+
+    /*Queued writes are newer than what the device holds*/
+    if (!is_write) sched_overlay(vec, count);
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads count scattered blocks, each into its own BLOCK_SIZE buffer. */
+/*The vector is sorted in place and adjacent blocks are merged into  */
+/*as few device requests as possible.                                */
+/*------------------------------------------------------------------*/
+int read_blocks_v(block_iovec *vec, int count)
+{
+    return blocks_v(0, vec, count);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes count scattered blocks, same merging as read_blocks_v       */
+/*------------------------------------------------------------------*/
+int write_blocks_v(block_iovec *vec, int count)
+{
+    return blocks_v(1, vec, count);
+}
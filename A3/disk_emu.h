@@ -1,5 +1,108 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+#define DISK_BACKEND_STDIO 0  /* fseek + fread/fwrite per block, fflush per block */
+#define DISK_BACKEND_PREAD 1  /* one pread/pwrite per call on the image descriptor */
+#define DISK_BACKEND_MMAP  2  /* memcpy into a shared mapping of the image, msync on disk_sync() */
+#define DISK_BACKEND_RAM   3  /* heap buffer, loaded from / optionally saved to the image file */
+#define DISK_BACKEND_STRIPED 4  /* RAID-0 over image files "<name>.0" .. "<name>.N-1" (disk_stripe.c) */
+
+#define DISK_AIO_AUTO    0  /* io_uring when the disk allows it, worker threads otherwise */
+#define DISK_AIO_URING   1
+#define DISK_AIO_THREADS 2
+
+/* Device model charged on every read_blocks/write_blocks call. Times are in
+ * microseconds, bandwidths in MB/s; 0 disables a term. */
+typedef struct {
+    const char *name;
+    double read_latency_us;    /* fixed cost of a read request */
+    double write_latency_us;   /* fixed cost of a write request */
+    double seek_us_per_block;  /* per block between the request and the previous one */
+    double max_seek_us;        /* full-stroke cap on the seek term */
+    double read_mb_per_s;
+    double write_mb_per_s;
+} disk_profile;
+
+extern const disk_profile DISK_PROFILE_IDEAL;  /* instant, the default */
+extern const disk_profile DISK_PROFILE_HDD;    /* 7200 rpm disk */
+extern const disk_profile DISK_PROFILE_SSD;    /* SATA flash */
+
+/* I/O statistics since init_*disk() or disk_reset_stats(). Calls are the
+ * read_blocks/write_blocks(_v) calls made; requests are what reached the
+ * device after queueing and merging. A request is sequential when it starts
+ * at the block after the previous request ended. */
+typedef struct {
+    long long read_calls;
+    long long write_calls;
+    long long read_requests;
+    long long write_requests;
+    long long blocks_read;
+    long long blocks_written;
+    long long bytes_read;
+    long long bytes_written;
+    double read_us;            /* wall time spent in device requests */
+    double write_us;
+    long long sequential;
+    long long random;
+} disk_stats;
+
+int disk_set_backend(int backend);
+int disk_set_profile(const disk_profile *profile);
+void disk_set_ram_persist(int persist);
+int disk_set_stripe(int members, int stripe_blocks);
+double disk_busy_us();
+void disk_get_stats(disk_stats *out);
+void disk_reset_stats();
+void disk_dump_stats(const char *label);
+void disk_set_stats_interval(int interval_ms);
+void disk_stats_request(int is_write, int start_address, int nblocks, double us);
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
+int disk_read_label(char *filename, void *buffer, int length);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+
+/* Scatter-gather I/O: one BLOCK_SIZE buffer per block number. The vector is
+ * sorted in place and runs of adjacent blocks go out as single requests. */
+typedef struct {
+    int block;
+    void *buffer;
+} block_iovec;
+
+int read_blocks_v(block_iovec *vec, int count);
+int write_blocks_v(block_iovec *vec, int count);
+
+/* Write scheduler: between disk_plug() and disk_unplug() the writes of the
+ * calling thread are queued, then dispatched sorted in one elevator sweep from
+ * the head position with adjacent blocks merged. Reads see queued data.
+ * disk_unplug() and disk_sync() return -1 if a queued write failed. */
+void disk_plug();
+int disk_unplug();
+void disk_set_sched_deadline(int deadline_ms);
+void disk_cancel_writes(int start_address, int nblocks);
+int disk_sync();
 int close_disk();
+int disk_direct_fd();
+
+/* Asynchronous submission queue (disk_aio.c) */
+typedef struct {
+    void *user_data;  /* as passed to disk_submit_* */
+    int result;       /* nblocks on success, -1 on error */
+} disk_completion;
+
+int disk_aio_init(int depth, int engine);
+int disk_aio_close();
+int disk_submit_read(int start_address, int nblocks, void *buffer, void *user_data);
+int disk_submit_write(int start_address, int nblocks, void *buffer, void *user_data);
+int disk_reap(disk_completion *out, int min_complete, int max_complete);
+int disk_aio_pending();
+
+/* Striped backend (disk_stripe.c), driven by disk_emu.c */
+#define DISK_STRIPE_MAX_MEMBERS 16
+void disk_model_member(int member, int is_write, int member_block, int nblocks);
+int stripe_open(char *filename, int fresh, int members, int stripe_blocks);
+int stripe_io(int is_write, int start_address, int nblocks, char *buffer, block_iovec *vec);
+int stripe_sync();
+void stripe_close();
+
+#endif
@@ -0,0 +1,196 @@
+/* disk_stripe.c
+ *
+ * Striped (RAID-0 style) backend for the disk emulator. The logical disk is
+ * spread over N member image files "<name>.0" .. "<name>.N-1": logical stripe s
+ * (stripe_blocks consecutive blocks) lives on member s % N, at member stripe
+ * s / N. A contiguous logical range therefore maps to one contiguous range per
+ * member, which is moved with a single preadv/pwritev. Large transfers run the
+ * members in parallel, one thread per member beyond the first. Each member is
+ * charged to the device model as a device of its own.
+ *
+ * disk_emu.c owns the device model, bounds checks and the scheduler and calls
+ * in here from device_read/device_write/transfer_run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "disk_emu.h"
+
+#define STRIPE_PARALLEL_MIN 32  // transfers of fewer blocks stay on the calling thread
+#define STRIPE_IOV_BATCH 64     // iovecs handed to one preadv/pwritev
+
+extern int BLOCK_SIZE, MAX_BLOCK;
+
+static int member_fd[DISK_STRIPE_MAX_MEMBERS];
+static int member_count = 0;
+static int stripe_blocks = 0;
+
+// One member's share of a transfer
+typedef struct {
+    int member;
+    int fd;
+    int is_write;
+    off_t offset;
+    struct iovec *iov;
+    int iovcnt;
+    int result;
+} member_job;
+
+// Moves every iovec of the job, resubmitting after short transfers
+static void *member_io(void *arg) {
+    member_job *job = arg;
+    struct iovec *iov = job->iov;
+    int left = job->iovcnt;
+    off_t offset = job->offset;
+    int nblocks = 0;
+    int i;
+
+    for (i = 0; i < job->iovcnt; i++) nblocks += job->iov[i].iov_len / BLOCK_SIZE;
+    disk_model_member(job->member, job->is_write, job->offset / BLOCK_SIZE, nblocks);
+
+    job->result = 0;
+    while (left > 0) {
+        int batch = (left < STRIPE_IOV_BATCH) ? left : STRIPE_IOV_BATCH;
+        ssize_t n = job->is_write ? pwritev(job->fd, iov, batch, offset) : preadv(job->fd, iov, batch, offset);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            job->result = -1;
+            return NULL;
+        }
+        offset += n;
+        // Skip what was moved, trimming a partially moved iovec
+        while (left > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            left--;
+        }
+        if (left > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return NULL;
+}
+
+// Opens (or creates and sizes, when fresh) the member images of filename
+int stripe_open(char *filename, int fresh, int members, int unit) {
+    char name[512];
+    int i;
+    // Every member holds the same number of whole stripes
+    int member_stripes = (MAX_BLOCK + members * unit - 1) / (members * unit);
+
+    if (members < 1 || members > DISK_STRIPE_MAX_MEMBERS || unit < 1) {
+        printf("Invalid stripe geometry %d x %d blocks\n", members, unit);
+        return -1;
+    }
+
+    for (i = 0; i < members; i++) {
+        snprintf(name, sizeof(name), "%s.%d", filename, i);
+        member_fd[i] = open(name, fresh ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR, 0644);
+        if (member_fd[i] < 0 || (fresh && ftruncate(member_fd[i], (off_t)member_stripes * unit * BLOCK_SIZE) < 0)) {
+            printf("Could not %s stripe member %s\n\n", fresh ? "create" : "open", name);
+            member_count = i + (member_fd[i] >= 0);
+            stripe_close();
+            return -1;
+        }
+    }
+    member_count = members;
+    stripe_blocks = unit;
+    return 0;
+}
+
+void stripe_close() {
+    int i;
+
+    for (i = 0; i < member_count; i++) close(member_fd[i]);
+    member_count = 0;
+}
+
+int stripe_sync() {
+    int i, r = 0;
+
+    for (i = 0; i < member_count; i++) {
+        if (fsync(member_fd[i]) < 0) r = -1;
+    }
+    return r;
+}
+
+// Moves nblocks logical blocks from start_address. The data is either the
+// contiguous buffer, or one BLOCK_SIZE buffer per block in vec when vec is set.
+int stripe_io(int is_write, int start_address, int nblocks, char *buffer, block_iovec *vec) {
+    member_job jobs[DISK_STRIPE_MAX_MEMBERS];
+    pthread_t threads[DISK_STRIPE_MAX_MEMBERS];
+    int started[DISK_STRIPE_MAX_MEMBERS];
+    struct iovec *iov_pool = malloc((size_t)(nblocks + member_count) * sizeof(struct iovec));
+    struct iovec *next_iov = iov_pool;
+    int first_stripe = start_address / stripe_blocks;
+    int used = 0;
+    int i, m, r = nblocks;
+
+    if (iov_pool == NULL) {
+        printf("stripe I/O error at block %d: out of memory\n", start_address);
+        return -1;
+    }
+
+    // Member m's share starts in the first stripe at or after first_stripe that lands on m
+    for (m = 0; m < member_count; m++) {
+        int stripe = first_stripe + ((m - first_stripe % member_count) + member_count) % member_count;
+        int block = stripe * stripe_blocks;
+        int share = 0;
+
+        if (block < start_address) block = start_address;
+        jobs[used].member = m;
+        jobs[used].fd = member_fd[m];
+        jobs[used].is_write = is_write;
+        jobs[used].offset = ((off_t)(stripe / member_count) * stripe_blocks + block % stripe_blocks) * BLOCK_SIZE;
+        jobs[used].iov = next_iov;
+        jobs[used].iovcnt = 0;
+
+        // Walk this member's stripes; a contiguous buffer gets one iovec per stripe
+        for (; block < start_address + nblocks; stripe += member_count, block = stripe * stripe_blocks) {
+            int end = (stripe + 1) * stripe_blocks;
+            if (end > start_address + nblocks) end = start_address + nblocks;
+            if (vec == NULL) {
+                next_iov->iov_base = buffer + (size_t)(block - start_address) * BLOCK_SIZE;
+                next_iov->iov_len = (size_t)(end - block) * BLOCK_SIZE;
+                next_iov++;
+                jobs[used].iovcnt++;
+            } else {
+                for (i = block; i < end; i++) {
+                    next_iov->iov_base = vec[i - start_address].buffer;
+                    next_iov->iov_len = BLOCK_SIZE;
+                    next_iov++;
+                    jobs[used].iovcnt++;
+                }
+            }
+            share += end - block;
+        }
+        if (share > 0) used++;
+    }
+
+    // The calling thread takes the first member; the others get a thread each
+    // once the transfer is large enough to pay for the thread start
+    for (i = 1; i < used; i++) {
+        started[i] = nblocks >= STRIPE_PARALLEL_MIN && pthread_create(&threads[i], NULL, member_io, &jobs[i]) == 0;
+        if (!started[i]) member_io(&jobs[i]);
+    }
+    if (used > 0) member_io(&jobs[0]);
+    for (i = 1; i < used; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < used; i++) {
+        if (jobs[i].result < 0) {
+            printf("stripe I/O error at block %d\n", start_address);
+            r = -1;
+        }
+    }
+    free(iov_pool);
+    return r;
+}
@@ -10,13 +10,118 @@
 #include <dirent.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/* Open files keep their sfs descriptor in fi->fh until released, so reads
+ * and writes go straight to sfs_pread/sfs_pwrite. sfs_fopen hands out one
+ * descriptor per file, so handles on the same file share it: it is closed
+ * when the last one is released. The handle also carries the descriptor's
+ * generation, bumped when unlink or truncate take the descriptor away;
+ * I/O through such a stale handle fails with EBADF. Reads, writes and
+ * syncs pin the descriptor while they run, and it is only closed or
+ * removed once nothing pins it, so its number cannot be handed to another
+ * file in the middle of a call.
+ */
+#define FUSE_MAX_FDS 256
+
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handle_idle = PTHREAD_COND_INITIALIZER;
+static int handle_count[FUSE_MAX_FDS];
+static int handle_busy[FUSE_MAX_FDS];
+static uint32_t handle_generation[FUSE_MAX_FDS];
+
+static uint64_t handle_open(int fd)
+{
+    uint64_t fh;
+    
+    pthread_mutex_lock(&handle_lock);
+    handle_count[fd]++;
+    fh = ((uint64_t)handle_generation[fd] << 32) | (uint32_t)fd;
+    pthread_mutex_unlock(&handle_lock);
+    return fh;
+}
+
+/* Pins the descriptor behind a handle until handle_unpin, or returns -1
+ * if it was taken away */
+static int handle_pin(uint64_t fh)
+{
+    int fd = (int)(fh & 0xFFFFFFFF), res = -1;
+    
+    if (fd < 0 || fd >= FUSE_MAX_FDS)
+        return -1;
+    pthread_mutex_lock(&handle_lock);
+    if (handle_generation[fd] == (uint32_t)(fh >> 32) && handle_count[fd] > 0) {
+        handle_busy[fd]++;
+        res = fd;
+    }
+    pthread_mutex_unlock(&handle_lock);
+    return res;
+}
+
+static void handle_unpin(int fd)
+{
+    pthread_mutex_lock(&handle_lock);
+    if (--handle_busy[fd] == 0)
+        pthread_cond_broadcast(&handle_idle);
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/* Called with handle_lock held: waits until no call uses fd */
+static void handle_wait_idle(int fd)
+{
+    while (handle_busy[fd] > 0)
+        pthread_cond_wait(&handle_idle, &handle_lock);
+}
+
+static void handle_close(uint64_t fh)
+{
+    int fd = (int)(fh & 0xFFFFFFFF);
+    
+    pthread_mutex_lock(&handle_lock);
+    if (handle_generation[fd] == (uint32_t)(fh >> 32) && handle_count[fd] > 0
+            && --handle_count[fd] == 0) {
+        /* No new pins from here on */
+        handle_generation[fd]++;
+        handle_wait_idle(fd);
+        sfs_fclose(fd);
+    }
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/* Called with handle_lock held before sfs_remove releases fd: no new
+ * pins, and the calls running on it are waited for */
+static void handle_forget(int fd)
+{
+    if (fd >= 0 && fd < FUSE_MAX_FDS) {
+        if (handle_count[fd] > 0) {
+            handle_count[fd] = 0;
+            handle_generation[fd]++;
+        }
+        handle_wait_idle(fd);
+    }
+}
+
+/* Removes a file, invalidating the handles open on it */
+static int remove_file(char *filename)
+{
+    int fd = -1, res;
+    
+    pthread_mutex_lock(&handle_lock);
+    if (sfs_getfilesize(filename) != -1)
+        fd = sfs_fopen(filename);
+    handle_forget(fd);
+    res = sfs_remove(filename);
+    pthread_mutex_unlock(&handle_lock);
+    return res;
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
-    int size;
+    long long size;
     
     memset(stbuf, 0, sizeof(struct stat));
     
@@ -57,7 +162,7 @@ static int fuse_unlink(const char *path)
     char filename[MAXFILENAME];
     
     strcpy(filename, path);
-    res = sfs_remove(filename);
+    res = remove_file(filename);
     if (res == -1)
         return -errno;
     
@@ -75,7 +180,17 @@ static int fuse_open(const char *path, struct fuse_file_info *fi)
     if (res == -1)
         return -errno;
     
-    sfs_fclose(res);
+    if (res >= FUSE_MAX_FDS) {
+        sfs_fclose(res);
+        return -EMFILE;
+    }
+    fi->fh = handle_open(res);
+    return 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    handle_close(fi->fh);
     return 0;
 }
 
@@ -85,22 +200,14 @@ static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
     int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
+    fd = handle_pin(fi->fh);
     if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+        return -EBADF;
     
-    res = sfs_fread(fd, buf, size);
+    res = sfs_pread(fd, buf, size, offset);
+    handle_unpin(fd);
     if (res == -1)
-        return -errno;
-    
-    sfs_fclose(fd);
+        return -EIO;
     return res;
 }
 
@@ -110,23 +217,31 @@ static int fuse_write(const char *path, const char *buf, size_t size,
     int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
+    fd = handle_pin(fi->fh);
+    if (fd == -1)
+        return -EBADF;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
+    res = sfs_pwrite(fd, buf, size, offset);
+    handle_unpin(fd);
+    if (res == -1)
+        return -EIO;
+    return res;
+}
+
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int fd;
+    int res;
     
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    fd = handle_pin(fi->fh);
+    if (fd == -1)
+        return -EBADF;
     
-    res = sfs_fwrite(fd, buf, size);
+    res = sfs_fsync(fd);
+    handle_unpin(fd);
     if (res == -1)
-        return -errno;
-    
-    sfs_fclose(fd);
-    return res;
+        return -EIO;
+    return 0;
 }
 
 static int fuse_truncate(const char *path, off_t size)
@@ -136,7 +251,7 @@ static int fuse_truncate(const char *path, off_t size)
     
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
+    fd = remove_file(filename);
     if (fd == -1)
         return -errno;
     
@@ -162,11 +277,23 @@ static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp
     
     strcpy(filename, path);
     fd = sfs_fopen(filename);
+    if (fd == -1)
+        return -errno;
     
-    sfs_fclose(fd);
+    if (fd >= FUSE_MAX_FDS) {
+        sfs_fclose(fd);
+        return -EMFILE;
+    }
+    fp->fh = handle_open(fd);
     return 0;
 }
 
+/* Unmounted: everything still in memory goes to the disk image */
+static void fuse_destroy(void *private_data)
+{
+    sfs_sync();
+}
+
 static struct fuse_operations xmp_oper = {
     .getattr = fuse_getattr,
     .readdir = fuse_readdir,
@@ -174,10 +301,13 @@ static struct fuse_operations xmp_oper = {
     .unlink = fuse_unlink,
     .truncate = fuse_truncate,
     .open = fuse_open, 
+    .release = fuse_release,
+    .fsync = fuse_fsync,
     .read = fuse_read, 
     .write = fuse_write, 
     .access = fuse_access,
     .create = fuse_create,
+    .destroy = fuse_destroy,
 };
 
 int main(int argc, char *argv[])
@@ -2,25 +2,54 @@
 
 #include "sfs_api.h"
 #include "disk_emu.h"
+#include "sfs_cache.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+// Geometry of the mounted disk - chosen by mksfs_with_geometry() and kept in the superblock
+#define BLOCK_SIZE (super_block.block_size)                 // In bytes
+#define BLOCK_NUMBER (super_block.file_system_size)         // Amount of blocks
+#define INODE_BLOCK_NUMBER (super_block.inode_table_length) // Blocks of the inode table
+#define DIRECTORY_BLOCK_NUMBER (super_block.directory_table_length) // Blocks of the directory table
+#define INODE_DIR_ENTRY_LENGTH (super_block.inode_count)    // Number of entries in both inode and directory table
+#define FREEBITMAP_WORDS ((BLOCK_NUMBER + 63) / 64)                // One bit per block, 64 blocks per word
+#define FREEBITMAP_BLOCKS ((FREEBITMAP_WORDS * 8 + BLOCK_SIZE - 1) / BLOCK_SIZE) // 1 block for the default geometry
+#define INODE_TABLE_SIZE (INODE_DIR_ENTRY_LENGTH * sizeof(inode))             // In bytes
+#define DIRECTORY_TABLE_SIZE (INODE_DIR_ENTRY_LENGTH * sizeof(directoryEntry)) // In bytes
+#define FREEBITMAP_SIZE (FREEBITMAP_WORDS * sizeof(uint64_t))                  // In bytes
 
 // Constants
-#define BLOCK_SIZE 1024             // In bytes
-#define BLOCK_NUMBER 4096           // Amount of blocks
-#define FREEBITMAP_BLOCKS 16        // Free bitmap takes 16 blocks
-#define MAX_FILE_SIZE 274432        // From 12B + B^2/d -> in bytes
 #define MAX_FILE_NAME 16            // Max file length - 15 + 1 (the null terminator)
-#define INODE_BLOCK_NUMBER 7        // Inode takes 7 blocks
-#define DIRECTORY_BLOCK_NUMBER 3    // Directory takes 3 blocks
-#define INODE_DIR_ENTRY_LENGTH 126  // Number of entries in both inode and directory table
 #define MAX_FILE_DESCRIPTOR 16      // Max amount of file open
+#define MIN_BLOCK_SIZE 512          // Smallest block size mksfs_with_geometry() accepts
+#define MAX_BLOCK_SIZE 1048576      // Largest block size mksfs_with_geometry() accepts
 #define FILENAME_FOR_DISK "sfs.disk"// Name for the disk
-#define MAGIC 0xACBD0005            // Magic number found in handout
-#define MAX_DIRECT_PTR 12           // Number of direct pointers
+#define READAHEAD_DEFAULT_KB 128    // Largest readahead window, unless SFS_READAHEAD_KB says otherwise
+#define READAHEAD_MIN_BLOCKS 4      // Window of the first read found to follow on from the one before
+#define WRITEBACK_DEFAULT_KB 1024   // Data held back from allocation, unless SFS_WRITEBACK_KB says otherwise
+#define WRITEBACK_DEADLINE_MS 5000  // Held back data older than this is committed by the flusher
+#define FLUSHER_INTERVAL_MS 1000    // How often the flusher thread looks for expired held data
+#define MAGIC 0xACBD0005            // Magic number found in handout - block pointer inodes, one int per block in the free bitmap
+#define MAGIC_EXTENTS 0xACBD0006    // Inodes hold extents instead of block pointers, the free bitmap is packed from here on
+#define MAGIC_LARGE 0xACBD0007      // 64-bit sizes, extents up to a double indirect block
+#define MAGIC_GEOMETRY 0xACBD0008   // Same inodes, the superblock records the whole geometry
+#define LEGACY_DIRECT_PTR 12        // Number of direct pointers in MAGIC and MAGIC_EXTENTS inodes
+#define LEGACY_FREEBITMAP_BLOCKS 16 // Blocks of the int free bitmap of MAGIC images
+#define MAX_DIRECT_PTR 10           // Direct pointer slots, holding the inline extents
+#define INLINE_EXTENTS (MAX_DIRECT_PTR / 2)       // Extents kept in the direct pointer slots
+#define BLOCK_EXTENTS (BLOCK_SIZE / 8)            // Extents in one extent block
+#define BLOCK_POINTERS (BLOCK_SIZE / 4)           // Extent block pointers in the double indirect block
+#define MAX_EXTENTS (INLINE_EXTENTS + BLOCK_EXTENTS + (long long)BLOCK_POINTERS * BLOCK_EXTENTS) // past INT_MAX for 256 KiB blocks and up
+#define INODE_TABLE_START 1                                         // First block of the inode table
+#define DIRECTORY_START (INODE_BLOCK_NUMBER + 1)                    // First block of the directory table
+#define FREEBITMAP_START (BLOCK_NUMBER - FREEBITMAP_BLOCKS - 1)     // First block of the free bitmap
+#define LEGACY_FREEBITMAP_START (BLOCK_NUMBER - LEGACY_FREEBITMAP_BLOCKS - 1) // First block of the int free bitmap
 
 typedef struct {
     int magic;
@@ -28,125 +57,1218 @@ typedef struct {
     int file_system_size;   // # of blocks in the file system
     int inode_table_length; // # of blocks to contain all i-nodes
     int root_directory;     // pointer to the i-node for the root directory
+    int directory_table_length; // # of blocks to contain all directory entries
+    int inode_count;        // # of i-nodes, and of directory entries
 } superBlock;
 
+// The geometry mksfs(1) formats with, which is also that of every image older than MAGIC_GEOMETRY
+const sfs_geometry SFS_GEOMETRY_DEFAULT = { 1024, 4096, 126 };
+
 typedef struct {
-    int size; // in bytes
+    int64_t size; // in bytes
     int direct_ptrs[MAX_DIRECT_PTR]; // array for direct pointers
     int indirect_ptr; // indirect pointer
+    int double_indirect_ptr; // double indirect pointer
 } inode; // has a size of 56 bytes
 
+// Inodes of MAGIC and MAGIC_EXTENTS images, converted when they are mounted
+typedef struct {
+    int size;
+    int direct_ptrs[LEGACY_DIRECT_PTR];
+    int indirect_ptr;
+} legacyInode; // has a size of 56 bytes
+
+// The direct pointer slots hold INLINE_EXTENTS extents, indirect_ptr points to a
+// block of BLOCK_EXTENTS more and double_indirect_ptr to a block of pointers to
+// further extent blocks, each used once the previous level is full.
+// Unused extents have length 0, unused pointers are -1.
+typedef struct {
+    int start;  // first block of the run
+    int length; // blocks in the run
+} extent;
+
 typedef struct {
     int used; // used directory entry or not
     int inode_number; // inode number
     char filename[MAX_FILE_NAME]; // file
 } directoryEntry; // has a size of 24 bytes
 
+// Free slots of a table as a stack - taking and returning a slot is O(1)
+typedef struct {
+    int *slots;
+    int count;
+} freeList;
+
 typedef struct {
     int inode_number; // inode number 
-    int rw_pointer; // rw pointer
+    int64_t rw_pointer; // rw pointer
+    int *block_map; // physical block of every file block, flattened from the extents
+    int block_map_length; // blocks in block_map, -1 until it is loaded
+    pthread_mutex_t lock; // rw_pointer, block_map and readahead, between readers sharing the descriptor
+    int64_t ra_next; // file offset a sequential read would start at, -1 before the first read
+    int ra_window; // blocks to keep read ahead of sequential reads, 0 while reads are not sequential
+    int ra_end; // first file block not read ahead yet
 } fileDescriptorEntry;
 
-// Global variables - cache
+// File data written past the blocks an inode has on disk, held in memory without
+// blocks allocated for it until it is committed (delayed allocation)
+typedef struct {
+    char *data; // block_count blocks, zero past what was written
+    int first_block; // file block of data[0] - the first block not written to the disk
+    int block_count;
+    int capacity; // blocks data has room for
+    int reserved; // free blocks promised to this data, extent blocks included
+    int64_t size; // file size including the held data, -1 when nothing is held
+    struct timespec since; // when the data started being held
+} delayedData;
+
+// Global variables - cache, the tables sized for the mounted geometry by allocate_tables()
 superBlock super_block;
 fileDescriptorEntry file_descriptor_table[MAX_FILE_DESCRIPTOR];
-directoryEntry directory_table[INODE_DIR_ENTRY_LENGTH];
-inode inode_table[INODE_DIR_ENTRY_LENGTH];
-int free_bitmap_array[BLOCK_NUMBER];
+directoryEntry *directory_table;
+inode *inode_table;
+uint64_t *free_bitmap_array; // bit i of word w is block 64w + i, 1 if free
+int free_bitmap_hint; // word the next allocation starts scanning from
 // For sfs_getnextfilename()
 int current_directory_filename;
+// Filename -> directory entry, open addressing with linear probing (-1 = empty bucket)
+int *directory_index;
+int directory_index_size; // buckets - power of two, at least 2x INODE_DIR_ENTRY_LENGTH
+// File descriptor open on each inode, -1 if the file is not open
+int *inode_descriptor;
+// Unused directory entries, inodes and file descriptors
+freeList free_directory_entries;
+freeList free_inodes;
+freeList free_descriptors;
+// Blocks of each on-disk table changed since the last flush_metadata()
+bool *inode_dirty_blocks;
+bool *directory_dirty_blocks;
+bool *bitmap_dirty_blocks;
+
+// Locking, taken in this order: the inode's reader/writer lock (shared to read a file,
+// exclusive to write, close or remove it), then a descriptor's lock, then fs_lock for
+// the namespace, the allocator, the descriptor table and the metadata tables.
+// The cache and the disk emulator lock for themselves. mksfs runs alone.
+pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t *inode_locks;
+int inode_lock_count;
+pthread_mutex_t zero_write_lock = PTHREAD_MUTEX_INITIALIZER; // sfs_remove's queued writes
+
+// Largest readahead window in blocks, set at mount from SFS_READAHEAD_KB (0 turns it off)
+int readahead_blocks;
+
+// Delayed allocation, per inode. Up to writeback_blocks blocks are held over all inodes,
+// set at mount from SFS_WRITEBACK_KB (0 writes through). Guarded by the inode's lock,
+// the counters and sizes by fs_lock too.
+delayedData *delayed;
+int writeback_blocks;
+int delayed_blocks; // blocks held, all inodes
+int free_block_count; // free blocks in the bitmap
+int reserved_blocks; // of those, promised to held data
+// Flusher thread, running while a disk with delayed allocation is mounted
+pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+pthread_t flusher;
+bool flusher_running;
+bool flusher_stop;
+
+// Group commit: sync requests take increasing tickets, and one flush and device barrier
+// completes every ticket handed out before it started. Guarded by sync_lock.
+pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sync_done = PTHREAD_COND_INITIALIZER;
+unsigned long sync_requested; // last ticket handed out
+unsigned long sync_completed; // every ticket up to this one is on the disk
+bool sync_running; // a flush is being written
+int sync_result; // of the last flush, 0 or -1
+
+// ------- Helpers for metadata write-back -----------------
+
+// Marks the table blocks that hold bytes [offset, offset + length) of a table
+void mark_dirty(bool *dirty_blocks, size_t offset, size_t length) {
+    for (size_t block = offset / BLOCK_SIZE; block <= (offset + length - 1) / BLOCK_SIZE; block++) {
+        dirty_blocks[block] = true;
+    }
+}
 
-// ------- Helper functions for free bitmap ----------------
+void mark_inode_dirty(int inode_number) {
+    mark_dirty(inode_dirty_blocks, inode_number * sizeof(inode), sizeof(inode));
+}
 
-// Returns the index of the first free block
-int allocate_block_FBM() {
-    for (int i = 0; i < BLOCK_NUMBER; i++) {
-        // if 1 then free to use, 0 if occupied
-        if (free_bitmap_array[i] == 1) {
-            free_bitmap_array[i] = 0;
-            return i;
+void mark_directory_dirty(int entry) {
+    mark_dirty(directory_dirty_blocks, entry * sizeof(directoryEntry), sizeof(directoryEntry));
+}
+
+void mark_bitmap_dirty(int index) {
+    mark_dirty(bitmap_dirty_blocks, (index / 64) * sizeof(free_bitmap_array[0]), sizeof(free_bitmap_array[0]));
+}
+
+// Writes the dirty blocks of one table, a run of adjacent dirty blocks per request.
+// The last block of a table that does not fill it goes through a zero padded copy.
+int flush_table(int first_block, void *table, size_t table_size, bool *dirty_blocks, int block_count) {
+    char *tail = NULL;
+    int result = 0;
+
+    for (int i = 0, run = 1; i < block_count; i += run) {
+        for (run = 1; i + run < block_count && dirty_blocks[i + run] == dirty_blocks[i]; run++);
+        if (!dirty_blocks[i]) continue;
+
+        int whole = run;
+        if ((size_t)(i + run) * BLOCK_SIZE > table_size) whole--;
+        if (whole > 0 && write_blocks(first_block + i, whole, (char *)table + (size_t)i * BLOCK_SIZE) < 0) result = -1;
+        if (whole < run) {
+            if (tail == NULL) tail = (char*) malloc(BLOCK_SIZE);
+            memset(tail, 0, BLOCK_SIZE);
+            memcpy(tail, (char *)table + (size_t)(i + whole) * BLOCK_SIZE, table_size - (size_t)(i + whole) * BLOCK_SIZE);
+            if (write_blocks(first_block + i + whole, 1, tail) < 0) result = -1;
         }
+        memset(dirty_blocks + i, 0, run * sizeof(bool));
+    }
+    free(tail);
+    return result;
+}
+
+// Reads a whole table, without writing past its end into the next global
+int load_table(int first_block, void *table, size_t table_size, int block_count) {
+    char *blocks = malloc((size_t)block_count * BLOCK_SIZE);
+    int result = read_blocks(first_block, block_count, blocks);
+
+    memcpy(table, blocks, table_size);
+    free(blocks);
+    return result;
+}
+
+// Writes the superblock, padded to a whole block
+int flush_superblock() {
+    bool dirty = true;
+    return flush_table(0, &super_block, sizeof(super_block), &dirty, 1);
+}
+
+// Writes back every metadata block changed since the last flush. Plugged, so the
+// scheduler merges what it can and visits the tables in one sweep.
+int flush_metadata() {
+    int result = 0;
+
+    disk_plug();
+    if (flush_table(INODE_TABLE_START, inode_table, INODE_TABLE_SIZE, inode_dirty_blocks, INODE_BLOCK_NUMBER) < 0) result = -1;
+    if (flush_table(DIRECTORY_START, directory_table, DIRECTORY_TABLE_SIZE, directory_dirty_blocks, DIRECTORY_BLOCK_NUMBER) < 0) result = -1;
+    if (flush_table(FREEBITMAP_START, free_bitmap_array, FREEBITMAP_SIZE, bitmap_dirty_blocks, FREEBITMAP_BLOCKS) < 0) result = -1;
+    // The parked writes only reach the device here
+    if (disk_unplug() < 0) result = -1;
+    return result;
+}
+// ---------------------------------------------------------
+
+// ------- Helper functions for free bitmap ----------------
+
+bool block_free_FBM(int index) {
+    return (free_bitmap_array[index / 64] >> (index % 64)) & 1;
+}
+
+// Marks a block used without searching, for the blocks the file system itself occupies
+void reserve_block_FBM(int index) {
+    if (block_free_FBM(index)) free_block_count--;
+    free_bitmap_array[index / 64] &= ~((uint64_t)1 << (index % 64));
+    mark_bitmap_dirty(index);
+}
+
+// Returns the index of a free block without taking it. The scan goes a word (64
+// blocks) at a time, starting at the word the last allocation came from and
+// wrapping around, so it does not rescan the full front of the disk every time.
+int find_free_FBM() {
+    for (int n = 0; n < FREEBITMAP_WORDS; n++) {
+        int w = (free_bitmap_hint + n) % FREEBITMAP_WORDS;
+        // if a bit is 1 then free to use, 0 if occupied
+        if (free_bitmap_array[w] == 0) continue;
+        return w * 64 + __builtin_ctzll(free_bitmap_array[w]);
+    }
+    return -1;
+}
+
+// Returns the first block of a completely free word (64 free blocks in a row) from
+// the hint on, or -1 if none is left
+int find_free_word_FBM() {
+    for (int n = 0; n < FREEBITMAP_WORDS; n++) {
+        int w = (free_bitmap_hint + n) % FREEBITMAP_WORDS;
+        if (free_bitmap_array[w] == ~(uint64_t)0) return w * 64;
     }
     return -1;
 }
 
+// Returns the index of a free block and marks it used
+int allocate_block_FBM() {
+    int index = find_free_FBM();
+    if (index >= 0) reserve_block_FBM(index);
+    return index;
+}
+
+// Allocates a run of up to max contiguous blocks and returns its first block.
+// The run starts at goal when that block is free, so a file that grows keeps
+// extending its last extent. Otherwise it opens a fully free word, which leaves
+// room to grow before the next file, and only then takes any free block.
+int allocate_run_FBM(int goal, int max, int *length) {
+    int start = (goal >= 0 && goal < BLOCK_NUMBER && block_free_FBM(goal)) ? goal : find_free_word_FBM();
+    int n = 0;
+
+    if (start < 0) start = find_free_FBM();
+
+    if (start < 0) return -1;
+    while (n < max && start + n < BLOCK_NUMBER && block_free_FBM(start + n)) {
+        reserve_block_FBM(start + n);
+        n++;
+    }
+    free_bitmap_hint = (start + n - 1) / 64;
+    *length = n;
+    return start;
+}
+
+// Counts the free blocks of a bitmap just loaded or initialized
+void count_free_FBM() {
+    free_block_count = 0;
+    for (int w = 0; w < FREEBITMAP_WORDS; w++) free_block_count += __builtin_popcountll(free_bitmap_array[w]);
+    reserved_blocks = 0;
+}
+
 // Deallocates the block (frees)
 void deallocate_block_FBM(int index_to_free) {
-    free_bitmap_array[index_to_free] = 1;
+    if (!block_free_FBM(index_to_free)) free_block_count++;
+    free_bitmap_array[index_to_free / 64] |= (uint64_t)1 << (index_to_free % 64);
+    mark_bitmap_dirty(index_to_free);
 }
 // ---------------------------------------------------------
 
-void mksfs(int fresh) {
-    if(fresh){
-        // Create new file system
-        init_fresh_disk(FILENAME_FOR_DISK, BLOCK_SIZE, BLOCK_NUMBER);
-
-        // Initialize the superblock
-        super_block.magic = MAGIC;
-        super_block.block_size = BLOCK_SIZE;
-        super_block.file_system_size = BLOCK_NUMBER;
-        super_block.inode_table_length = INODE_BLOCK_NUMBER;
-        super_block.root_directory = 0;
-        
-        // Initialize the free bitmap
+// ------- Helpers for extents -----------------------------
+
+// Reads the count extents of an extent block (at most BLOCK_EXTENTS) into list.
+// Returns how many were in use. Extent and pointer blocks are read into heap buffers:
+// with the largest block sizes they would not fit on a thread's stack.
+int read_extent_block(int block, extent *list) {
+    extent *extents = (extent*) malloc(BLOCK_SIZE);
+    int count = 0;
+
+    cache_read(block, extents);
+    while (count < BLOCK_EXTENTS && extents[count].length > 0) {
+        list[count] = extents[count];
+        count++;
+    }
+    free(extents);
+    return count;
+}
+
+// Writes up to BLOCK_EXTENTS extents of list into an extent block, padding with unused ones
+void write_extent_block(int block, extent *list, int count) {
+    extent *extents = (extent*) malloc(BLOCK_SIZE);
+
+    for (int i = 0; i < BLOCK_EXTENTS; i++) {
+        extents[i].start = (i < count) ? list[i].start : -1;
+        extents[i].length = (i < count) ? list[i].length : 0;
+    }
+    cache_write(block, extents);
+    free(extents);
+}
+
+// Returns every extent of the inode, the inline ones, then those of the indirect
+// block and of the blocks under the double indirect block, in a list allocated
+// for the caller, and sets count to how many there are
+extent *load_extents(inode *node, int *count) {
+    extent *inline_extents = (extent *)node->direct_ptrs;
+    extent *list;
+    int n = 0;
+
+    for (int i = 0; i < INLINE_EXTENTS && inline_extents[i].length > 0; i++) n++;
+    if (n < INLINE_EXTENTS || node->indirect_ptr == -1) {
+        list = (extent*) malloc((n > 0 ? n : 1) * sizeof(extent));
+        memcpy(list, inline_extents, n * sizeof(extent));
+        *count = n;
+        return list;
+    }
+
+    int *pointers = (int*) malloc(BLOCK_SIZE);
+    int blocks = 0;
+    if (node->double_indirect_ptr != -1) {
+        cache_read(node->double_indirect_ptr, pointers);
+        while (blocks < BLOCK_POINTERS && pointers[blocks] != -1) blocks++;
+    }
+    list = (extent*) malloc((INLINE_EXTENTS + (size_t)(blocks + 1) * BLOCK_EXTENTS) * sizeof(extent));
+    memcpy(list, inline_extents, n * sizeof(extent));
+    int used = read_extent_block(node->indirect_ptr, list + n);
+    n += used;
+    for (int b = 0; b < blocks && used == BLOCK_EXTENTS; b++) {
+        used = read_extent_block(pointers[b], list + n);
+        n += used;
+    }
+    free(pointers);
+    *count = n;
+    return list;
+}
+
+// Stores count extents back into the inode, spilling into the indirect block and
+// then the blocks under the double indirect block (each allocated on first use).
+// Returns -1 if no block is left for them.
+int store_extents(inode *node, int inode_number, extent *list, int count) {
+    extent *inline_extents = (extent *)node->direct_ptrs;
+
+    for (int i = 0; i < INLINE_EXTENTS; i++) {
+        inline_extents[i].start = (i < count) ? list[i].start : -1;
+        inline_extents[i].length = (i < count) ? list[i].length : 0;
+    }
+    mark_inode_dirty(inode_number);
+    if (count <= INLINE_EXTENTS) return 0;
+
+    if (node->indirect_ptr == -1) {
+        node->indirect_ptr = allocate_block_FBM();
+        if (node->indirect_ptr < 0) return -1;
+    }
+    write_extent_block(node->indirect_ptr, list + INLINE_EXTENTS, count - INLINE_EXTENTS);
+    if (count <= INLINE_EXTENTS + BLOCK_EXTENTS) return 0;
+
+    int *pointers = (int*) malloc(BLOCK_SIZE);
+    int result = 0;
+    if (node->double_indirect_ptr == -1) {
+        node->double_indirect_ptr = allocate_block_FBM();
+        if (node->double_indirect_ptr < 0) {
+            free(pointers);
+            return -1;
+        }
+        for (int i = 0; i < BLOCK_POINTERS; i++) pointers[i] = -1;
+    } else {
+        cache_read(node->double_indirect_ptr, pointers);
+    }
+    for (int b = 0, first = INLINE_EXTENTS + BLOCK_EXTENTS; b < BLOCK_POINTERS && first < count; b++, first += BLOCK_EXTENTS) {
+        if (pointers[b] == -1 && (pointers[b] = allocate_block_FBM()) < 0) {
+            result = -1;
+            break;
+        }
+        write_extent_block(pointers[b], list + first, count - first);
+    }
+    cache_write(node->double_indirect_ptr, pointers);
+    free(pointers);
+    return result;
+}
+
+// Frees the indirect and double indirect extent blocks of an inode
+void free_extent_blocks(inode *node) {
+    if (node->double_indirect_ptr != -1) {
+        int *pointers = (int*) malloc(BLOCK_SIZE);
+        cache_read(node->double_indirect_ptr, pointers);
+        for (int b = 0; b < BLOCK_POINTERS && pointers[b] != -1; b++) {
+            cache_discard(pointers[b]);
+            deallocate_block_FBM(pointers[b]);
+        }
+        free(pointers);
+        cache_discard(node->double_indirect_ptr);
+        deallocate_block_FBM(node->double_indirect_ptr);
+    }
+    if (node->indirect_ptr != -1) {
+        cache_discard(node->indirect_ptr);
+        deallocate_block_FBM(node->indirect_ptr);
+    }
+    node->indirect_ptr = -1;
+    node->double_indirect_ptr = -1;
+}
+
+// Physical blocks behind file blocks [first, first + count), in file order.
+// Returns how many of them are allocated.
+int map_extents(extent *list, int extent_count, int first, int count, int *physical_blocks) {
+    int mapped = 0;
+    int file_block = 0;
+
+    for (int e = 0; e < extent_count && mapped < count; e++) {
+        for (int i = 0; i < list[e].length && mapped < count; i++, file_block++) {
+            if (file_block >= first) physical_blocks[mapped++] = list[e].start + i;
+        }
+    }
+    return mapped;
+}
+
+// Grows the file to blocks_needed blocks, a contiguous run at a time, enlarging
+// the list as extents are added. Returns the new extent count, or -1 when the disk
+// or the extent tree is full (the blocks allocated so far stay in the list).
+int grow_extents(extent **extent_list, int *extent_count, int blocks_needed) {
+    extent *list = *extent_list;
+    int have = 0;
+
+    for (int e = 0; e < *extent_count; e++) have += list[e].length;
+    while (have < blocks_needed) {
+        extent *last = (*extent_count > 0) ? &list[*extent_count - 1] : NULL;
+        int length;
+        int start = allocate_run_FBM(last ? last->start + last->length : -1, blocks_needed - have, &length);
+
+        if (start < 0) return -1;
+        if (last && start == last->start + last->length) {
+            last->length += length;
+        } else if (*extent_count == MAX_EXTENTS) {
+            for (int i = 0; i < length; i++) deallocate_block_FBM(start + i);
+            return -1;
+        } else {
+            list = *extent_list = (extent*) realloc(list, (*extent_count + 1) * sizeof(extent));
+            list[*extent_count].start = start;
+            list[*extent_count].length = length;
+            (*extent_count)++;
+        }
+        have += length;
+    }
+    return *extent_count;
+}
+
+// Forgets the block map of an open file, to be loaded again on next use
+void drop_block_map(fileDescriptorEntry *entry) {
+    free(entry->block_map);
+    entry->block_map = NULL;
+    entry->block_map_length = -1;
+}
+
+// Returns a free slot and takes it off the list, or -1 if the list is empty
+int pop_free_slot(freeList *list) {
+    return (list->count > 0) ? list->slots[--list->count] : -1;
+}
+
+void push_free_slot(freeList *list, int slot) {
+    list->slots[list->count++] = slot;
+}
+
+// Forgets the access pattern of a descriptor
+void reset_readahead(fileDescriptorEntry *entry) {
+    entry->ra_next = -1;
+    entry->ra_window = 0;
+    entry->ra_end = 0;
+}
+
+// Called for every read of length bytes at offset, under the descriptor's lock. A read
+// that starts where the previous one ended is sequential: the window doubles (up to
+// readahead_blocks) and, once fewer than half a window of blocks are left read ahead
+// past this read, the next ones up to a full window are returned in first/count for
+// the read to fetch along with its own. Any other read closes the window.
+void plan_readahead(fileDescriptorEntry *entry, int64_t offset, int length, int64_t file_size,
+        int *first, int *count) {
+    int last_block = (int)((offset + length - 1) / BLOCK_SIZE);
+    int file_blocks = (int)((file_size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    *count = 0;
+    if (entry->ra_next == offset && readahead_blocks > 0) {
+        entry->ra_window = (entry->ra_window == 0) ? READAHEAD_MIN_BLOCKS : entry->ra_window * 2;
+        if (entry->ra_window > readahead_blocks) entry->ra_window = readahead_blocks;
+    } else {
+        entry->ra_window = 0;
+        entry->ra_end = 0;
+    }
+    entry->ra_next = offset + length;
+    if (entry->ra_window == 0 || entry->ra_end - (last_block + 1) >= entry->ra_window / 2) return;
+
+    *first = (entry->ra_end > last_block + 1) ? entry->ra_end : last_block + 1;
+    int end = last_block + 1 + entry->ra_window;
+    if (end > file_blocks) end = file_blocks;
+    if (end > entry->block_map_length) end = entry->block_map_length;
+    if (end > *first) *count = end - *first;
+    entry->ra_end = (end > entry->ra_end) ? end : entry->ra_end;
+}
+
+// Closes a file descriptor table entry
+void release_descriptor(fileDescriptorEntry *entry) {
+    if (entry->inode_number != -1) {
+        inode_descriptor[entry->inode_number] = -1;
+        push_free_slot(&free_descriptors, entry - file_descriptor_table);
+    }
+    entry->inode_number = -1;
+    entry->rw_pointer = -1;
+    reset_readahead(entry);
+    drop_block_map(entry);
+}
+
+// Locks the inode an open descriptor refers to, shared or exclusive, and returns its
+// number. Returns -1, with nothing locked, if the descriptor is not open - also when
+// it was closed while the inode lock was awaited.
+int lock_descriptor_inode(int fileID, bool exclusive) {
+    if (fileID < 0 || fileID >= MAX_FILE_DESCRIPTOR) return -1;
+
+    pthread_mutex_lock(&fs_lock);
+    int inode_number = file_descriptor_table[fileID].inode_number;
+    pthread_mutex_unlock(&fs_lock);
+    if (inode_number == -1) return -1;
+
+    if (exclusive) pthread_rwlock_wrlock(&inode_locks[inode_number]);
+    else pthread_rwlock_rdlock(&inode_locks[inode_number]);
+    pthread_mutex_lock(&fs_lock);
+    bool still_open = file_descriptor_table[fileID].inode_number == inode_number;
+    pthread_mutex_unlock(&fs_lock);
+    if (!still_open) {
+        pthread_rwlock_unlock(&inode_locks[inode_number]);
+        return -1;
+    }
+    return inode_number;
+}
+
+// Returns the block map of an open file, flattening the extents of its inode the
+// first time, so the I/O paths index an array instead of walking extents
+int *file_block_map(fileDescriptorEntry *entry) {
+    if (entry->block_map_length < 0) {
+        int extent_count;
+        extent *extents = load_extents(&inode_table[entry->inode_number], &extent_count);
+        int total = 0;
+
+        for (int e = 0; e < extent_count; e++) total += extents[e].length;
+        entry->block_map = (int*) malloc((total > 0 ? total : 1) * sizeof(int));
+        entry->block_map_length = map_extents(extents, extent_count, 0, total, entry->block_map);
+        free(extents);
+    }
+    return entry->block_map;
+}
+
+// Loads the free bitmap of a MAGIC image, one int per block (1 if free), into the
+// packed free_bitmap_array. The blocks it took in front of the packed bitmap are freed.
+// Images formatted once the bitmap was packed but before it had a magic of its own are
+// MAGIC too and hold a packed bitmap at FREEBITMAP_START: read as ints it does not give
+// 0 or 1 for every block with the metadata blocks used, and -1 is returned.
+int load_legacy_bitmap() {
+    int *entries = (int*) malloc((size_t)LEGACY_FREEBITMAP_BLOCKS * BLOCK_SIZE);
+    int count = LEGACY_FREEBITMAP_BLOCKS * BLOCK_SIZE / sizeof(int);
+    int result = read_blocks(LEGACY_FREEBITMAP_START, LEGACY_FREEBITMAP_BLOCKS, entries) < 0 ? -1 : 0;
+
+    if (count < BLOCK_NUMBER) result = -1;
+    for (int i = 0; result == 0 && i < BLOCK_NUMBER; i++) {
+        bool metadata = i <= INODE_BLOCK_NUMBER + DIRECTORY_BLOCK_NUMBER || i >= LEGACY_FREEBITMAP_START;
+        if (entries[i] != 0 && (entries[i] != 1 || metadata)) result = -1;
+    }
+    if (result == 0) {
+        memset(free_bitmap_array, 0, FREEBITMAP_SIZE);
         for (int i = 0; i < BLOCK_NUMBER; i++) {
-            free_bitmap_array[i] = 1; // 1 means free to use, 0 means used
+            if (entries[i] == 1 || (i >= LEGACY_FREEBITMAP_START && i < FREEBITMAP_START)) {
+                free_bitmap_array[i / 64] |= (uint64_t)1 << (i % 64);
+            }
+        }
+        mark_dirty(bitmap_dirty_blocks, 0, FREEBITMAP_SIZE);
+    }
+    free(entries);
+    return result;
+}
+
+// Marks used every block the inodes of an older image (MAGIC or MAGIC_EXTENTS) map,
+// their indirect block included. Run before they are converted, so the bitmap loaded
+// with them cannot hand out a block a file still holds.
+void reserve_legacy_blocks(legacyInode *legacy_table, int magic) {
+    int *pointers = (int*) malloc(BLOCK_SIZE);
+    // The extents of a MAGIC_EXTENTS inode: its own and a block of them
+    extent *list = (extent*) malloc(LEGACY_DIRECT_PTR / 2 * sizeof(extent) + BLOCK_SIZE);
+
+    for (int n = 0; n < INODE_DIR_ENTRY_LENGTH; n++) {
+        legacyInode *old = &legacy_table[n];
+        int count = 0;
+
+        if (old->size < 0) continue;
+        if (magic == MAGIC_EXTENTS) {
+            extent *old_extents = (extent *)old->direct_ptrs;
+            for (int i = 0; i < LEGACY_DIRECT_PTR / 2 && old_extents[i].length > 0; i++) list[count++] = old_extents[i];
+            if (count == LEGACY_DIRECT_PTR / 2 && old->indirect_ptr != -1) count += read_extent_block(old->indirect_ptr, list + count);
+        } else {
+            if (old->indirect_ptr != -1) cache_read(old->indirect_ptr, pointers);
+            for (int i = 0; i < LEGACY_DIRECT_PTR + (int)(BLOCK_SIZE/sizeof(int)); i++) {
+                int block = (i < LEGACY_DIRECT_PTR) ? old->direct_ptrs[i] : (old->indirect_ptr != -1 ? pointers[i - LEGACY_DIRECT_PTR] : -1);
+                if (block == -1) break;
+                if (block >= 0 && block < BLOCK_NUMBER) reserve_block_FBM(block);
+            }
+        }
+        if (old->indirect_ptr >= 0 && old->indirect_ptr < BLOCK_NUMBER) reserve_block_FBM(old->indirect_ptr);
+        for (int e = 0; e < count; e++) {
+            for (int b = list[e].start; b >= 0 && b < list[e].start + list[e].length && b < BLOCK_NUMBER; b++) reserve_block_FBM(b);
+        }
+    }
+    free(pointers);
+    free(list);
+}
+
+// Converts the inode table of an older image (MAGIC or MAGIC_EXTENTS, as given by
+// magic) into inode_table. Block pointers become extents, runs of consecutive
+// pointers one extent, and the indirect pointer block is freed; the extents of a
+// MAGIC_EXTENTS inode keep their overflow block as the indirect block.
+void migrate_legacy_inodes(legacyInode *legacy_table, int magic) {
+    int *pointers = (int*) malloc(BLOCK_SIZE);
+    // Enough for either layout: every pointer of a MAGIC inode its own extent
+    extent *list = (extent*) malloc((LEGACY_DIRECT_PTR + BLOCK_SIZE/sizeof(int)) * sizeof(extent));
+
+    for (int n = 0; n < INODE_DIR_ENTRY_LENGTH; n++) {
+        legacyInode *old = &legacy_table[n];
+        inode *node = &inode_table[n];
+        int count = 0;
+
+        node->size = old->size;
+        node->indirect_ptr = -1;
+        node->double_indirect_ptr = -1;
+        if (old->size < 0) {
+            for (int i = 0; i < MAX_DIRECT_PTR; i++) node->direct_ptrs[i] = (i % 2 == 0) ? -1 : 0;
+            continue;
+        }
+
+        if (magic == MAGIC_EXTENTS) {
+            extent *old_extents = (extent *)old->direct_ptrs;
+            for (int i = 0; i < LEGACY_DIRECT_PTR / 2 && old_extents[i].length > 0; i++) list[count++] = old_extents[i];
+            if (count == LEGACY_DIRECT_PTR / 2 && old->indirect_ptr != -1) count += read_extent_block(old->indirect_ptr, list + count);
+            node->indirect_ptr = old->indirect_ptr;
+        } else {
+            if (old->indirect_ptr != -1) cache_read(old->indirect_ptr, pointers);
+            for (int i = 0; i < LEGACY_DIRECT_PTR + (int)(BLOCK_SIZE/sizeof(int)); i++) {
+                int block = (i < LEGACY_DIRECT_PTR) ? old->direct_ptrs[i] : (old->indirect_ptr != -1 ? pointers[i - LEGACY_DIRECT_PTR] : -1);
+                if (block == -1) break;
+                if (count > 0 && block == list[count - 1].start + list[count - 1].length) {
+                    list[count - 1].length++;
+                } else {
+                    list[count].start = block;
+                    list[count].length = 1;
+                    count++;
+                }
+            }
+            if (old->indirect_ptr != -1) {
+                cache_discard(old->indirect_ptr);
+                deallocate_block_FBM(old->indirect_ptr);
+            }
+        }
+        if (store_extents(node, n, list, count) < 0) printf("Error: no block left for the extents of inode %d\n", n);
+    }
+    mark_dirty(inode_dirty_blocks, 0, INODE_TABLE_SIZE);
+    free(pointers);
+    free(list);
+}
+// ---------------------------------------------------------
+
+// ------- Helpers for the directory index ----------------
+
+// FNV-1a hash of a filename, reduced to a bucket of the directory index
+unsigned int hash_filename(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++) hash = (hash ^ (unsigned char)*name) * 16777619u;
+    return hash & (directory_index_size - 1);
+}
+
+// Returns the directory entry of the file called name, or -1 if there is none
+int find_directory_entry(const char *name) {
+    for (unsigned int b = hash_filename(name); directory_index[b] != -1; b = (b + 1) & (directory_index_size - 1)) {
+        if (strcmp(directory_table[directory_index[b]].filename, name) == 0) return directory_index[b];
+    }
+    return -1;
+}
+
+// Adds a directory entry to the index, under the filename it holds
+void index_directory_entry(int entry) {
+    unsigned int b = hash_filename(directory_table[entry].filename);
+    while (directory_index[b] != -1) b = (b + 1) & (directory_index_size - 1);
+    directory_index[b] = entry;
+}
 
-            // occupied if superblock, inode table, dir table, free bitmap
-            if (i == 0) free_bitmap_array[i] = 0;
-            if (i >= 1 && i <= INODE_BLOCK_NUMBER) free_bitmap_array[i] = 0;
-            if (i >= INODE_BLOCK_NUMBER + 1 && i <= INODE_BLOCK_NUMBER + DIRECTORY_BLOCK_NUMBER) free_bitmap_array[i] = 0;
-            if (i >= BLOCK_NUMBER - FREEBITMAP_BLOCKS - 1) free_bitmap_array[i] = 0;
+// Takes a directory entry out of the index (before its filename is cleared). The
+// entries probed after it move back into the hole, so no deleted markers pile up.
+void unindex_directory_entry(int entry) {
+    unsigned int mask = directory_index_size - 1;
+    unsigned int hole = hash_filename(directory_table[entry].filename);
+
+    while (directory_index[hole] != entry) hole = (hole + 1) & mask;
+    for (unsigned int b = (hole + 1) & mask; directory_index[b] != -1; b = (b + 1) & mask) {
+        unsigned int home = hash_filename(directory_table[directory_index[b]].filename);
+        // Movable unless its home bucket lies between the hole and b
+        if (((b - home) & mask) >= ((b - hole) & mask)) {
+            directory_index[hole] = directory_index[b];
+            hole = b;
         }
+    }
+    directory_index[hole] = -1;
+}
+
+// Indexes every entry of the directory table, at mount time
+void build_directory_index() {
+    for (int b = 0; b < directory_index_size; b++) directory_index[b] = -1;
+    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
+        if (directory_table[i].inode_number != -1) index_directory_entry(i);
+    }
+}
+// ---------------------------------------------------------
+
+// ------- Helper for the free slot lists ------------------
+
+// Collects the unused directory entries, inodes and file descriptors at mount time,
+// pushed highest first so the lowest slots are handed out first. Inodes no directory
+// entry refers to (left in use by sfs_remove before it freed them) are reclaimed.
+void build_free_lists() {
+    bool *referenced = (bool*) calloc(INODE_DIR_ENTRY_LENGTH, sizeof(bool));
 
-        // Initialize the inode table
-        for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
+    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
+        if (directory_table[i].inode_number != -1) referenced[directory_table[i].inode_number] = true;
+    }
+    free_directory_entries.count = 0;
+    free_inodes.count = 0;
+    free_descriptors.count = 0;
+    for (int i = INODE_DIR_ENTRY_LENGTH - 1; i >= 0; i--) {
+        if (directory_table[i].inode_number == -1) push_free_slot(&free_directory_entries, i);
+        if (!referenced[i] && inode_table[i].size != -1) {
             inode_table[i].size = -1;
-            inode_table[i].indirect_ptr = -1;
-            for (int j = 0; j < MAX_DIRECT_PTR; j++) {
-                inode_table[i].direct_ptrs[j] = -1;
+            mark_inode_dirty(i);
+        }
+        if (inode_table[i].size == -1) push_free_slot(&free_inodes, i);
+    }
+    for (int i = MAX_FILE_DESCRIPTOR - 1; i >= 0; i--) {
+        if (file_descriptor_table[i].inode_number == -1) push_free_slot(&free_descriptors, i);
+    }
+    free(referenced);
+}
+// ---------------------------------------------------------
+
+// ------- Helper for asynchronous block writes ------------
+
+// Waits until every block write queued with disk_submit_write() has completed.
+// Returns -1 if any of them failed.
+int drain_block_writes() {
+    disk_completion done[16];
+    int result = 0;
+    while (disk_aio_pending() > 0) {
+        int n = disk_reap(done, 1, 16);
+        for (int i = 0; i < n; i++) {
+            if (done[i].result < 0) {
+                printf("Error: asynchronous block write failed\n");
+                result = -1;
             }
         }
+    }
+    return result;
+}
+// ---------------------------------------------------------
+
+// ------- Helpers for delayed allocation -----------------
+
+// Size of a file with the data held for it
+int64_t file_size(int inode_number) {
+    return (delayed[inode_number].size >= 0) ? delayed[inode_number].size : inode_table[inode_number].size;
+}
+
+// Whether bytes [offset, offset + length) reach a file block past what an int indexes
+bool beyond_block_range(int64_t offset, int length) {
+    return offset > (int64_t)INT_MAX * BLOCK_SIZE - length;
+}
+
+// Free blocks to promise for count held blocks: the blocks and, should every one
+// become an extent of its own, the extent blocks
+int reservation_for(int count) {
+    return (count > 0) ? count + count / BLOCK_EXTENTS + 3 : 0;
+}
+
+// Forgets the data held for an inode. Called with fs_lock held.
+void discard_delayed(int inode_number) {
+    delayedData *d = &delayed[inode_number];
+
+    delayed_blocks -= d->block_count;
+    reserved_blocks -= d->reserved;
+    free(d->data);
+    d->data = NULL;
+    d->block_count = d->capacity = d->reserved = 0;
+    d->size = -1;
+}
+
+// Allocates blocks for the data held for an inode, as few runs as the disk allows,
+// and writes it in one vectored call. The caller holds the inode exclusively.
+// Returns -1 if the disk could not take all of it; what fit is kept. If the write
+// fails the data stays held, over the blocks now allocated for it, and the size on
+// disk is left alone until a later commit writes it.
+int commit_delayed(int inode_number) {
+    delayedData *d = &delayed[inode_number];
+    inode *inode = &inode_table[inode_number];
+    if (d->size < 0) return 0;
+
+    pthread_mutex_lock(&fs_lock);
+    // The promise is kept now - give it back before allocating
+    reserved_blocks -= d->reserved;
+    d->reserved = 0;
+    int extent_count;
+    extent *extents = load_extents(inode, &extent_count);
+    bool grown = grow_extents(&extents, &extent_count, d->first_block + d->block_count) >= 0;
+    if (store_extents(inode, inode_number, extents, extent_count) < 0) grown = false;
+    int* physical_blocks = (int*) malloc((d->block_count > 0 ? d->block_count : 1) * sizeof(int));
+    int mapped = map_extents(extents, extent_count, d->first_block, d->block_count, physical_blocks);
+    free(extents);
+    if (inode_descriptor[inode_number] != -1) drop_block_map(&file_descriptor_table[inode_descriptor[inode_number]]);
+    pthread_mutex_unlock(&fs_lock);
+
+    block_iovec* vector = (block_iovec*) malloc((mapped > 0 ? mapped : 1) * sizeof(block_iovec));
+    for (int i = 0; i < mapped; i++) {
+        cache_discard(physical_blocks[i]);
+        vector[i].block = physical_blocks[i];
+        vector[i].buffer = d->data + (size_t)i * BLOCK_SIZE;
+    }
+    bool written = mapped == 0 || write_blocks_v(vector, mapped) >= 0;
+    free(vector);
+    free(physical_blocks);
+    if (!written) {
+        printf("Error: cannot write block\n");
+        return -1;
+    }
+
+    // The size is set once the data is written
+    pthread_mutex_lock(&fs_lock);
+    int64_t size = d->size;
+    if (!grown) {
+        printf("Error allocating blocks - not enough space, sorry!\n");
+        int64_t fits = (int64_t)(d->first_block + mapped) * BLOCK_SIZE;
+        if (size > fits) size = fits;
+    }
+    if (size > inode->size) inode->size = size;
+    mark_inode_dirty(inode_number);
+    discard_delayed(inode_number);
+    pthread_mutex_unlock(&fs_lock);
+    return grown ? 0 : -1;
+}
+
+// Commits the data held longer than WRITEBACK_DEADLINE_MS. The inode the caller holds
+// (skip) is left to the caller; inodes that are busy are left for the next round.
+void expire_delayed(int skip) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
+        if (i == skip) continue;
+        pthread_mutex_lock(&fs_lock);
+        bool due = delayed[i].size >= 0 && (now.tv_sec - delayed[i].since.tv_sec) * 1000
+                + (now.tv_nsec - delayed[i].since.tv_nsec) / 1000000 >= WRITEBACK_DEADLINE_MS;
+        pthread_mutex_unlock(&fs_lock);
+        if (!due || pthread_rwlock_trywrlock(&inode_locks[i]) != 0) continue;
+        // It may have been committed while the lock was free
+        commit_delayed(i);
+        pthread_rwlock_unlock(&inode_locks[i]);
+    }
+}
+
+// Commits everything held, before the disk is unmounted or synced. Returns -1 if
+// any of it could not be written.
+int commit_all_delayed() {
+    int result = 0;
 
-        // Initialize the directory table
-        for (int i = 1; i < INODE_DIR_ENTRY_LENGTH; i++) {
-            directory_table[i].used = 0; // 0 means not used, 1 means used
-            directory_table[i].inode_number = -1;
-            strcpy(directory_table[i].filename, "");
+    if (delayed == NULL) return 0;
+    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
+        pthread_mutex_lock(&fs_lock);
+        bool held = delayed[i].size >= 0;
+        pthread_mutex_unlock(&fs_lock);
+        if (!held) continue;
+        pthread_rwlock_wrlock(&inode_locks[i]);
+        if (commit_delayed(i) < 0) result = -1;
+        pthread_rwlock_unlock(&inode_locks[i]);
+    }
+    return result;
+}
+
+// Commits expired held data every FLUSHER_INTERVAL_MS, so data held for a file nobody
+// writes to any more does not wait for its sfs_fclose
+static void *flusher_run(void *arg) {
+    pthread_mutex_lock(&flusher_lock);
+    while (!flusher_stop) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += FLUSHER_INTERVAL_MS / 1000;
+        wake.tv_nsec += (FLUSHER_INTERVAL_MS % 1000) * 1000000L;
+        if (wake.tv_nsec >= 1000000000L) {
+            wake.tv_sec++;
+            wake.tv_nsec -= 1000000000L;
         }
+        pthread_cond_timedwait(&flusher_wake, &flusher_lock, &wake);
+        if (flusher_stop) break;
+        pthread_mutex_unlock(&flusher_lock);
+        expire_delayed(-1);
+        pthread_mutex_lock(&flusher_lock);
+    }
+    pthread_mutex_unlock(&flusher_lock);
+    return NULL;
+}
+
+// Started by allocate_tables, stopped by mksfs before it changes the geometry
+void start_flusher() {
+    if (flusher_running || writeback_blocks <= 0) return;
+    flusher_stop = false;
+    if (pthread_create(&flusher, NULL, flusher_run, NULL) == 0) flusher_running = true;
+}
+
+// Stops the flusher and waits for it, before the tables it uses are replaced
+void stop_flusher() {
+    if (!flusher_running) return;
+    pthread_mutex_lock(&flusher_lock);
+    flusher_stop = true;
+    pthread_cond_broadcast(&flusher_wake);
+    pthread_mutex_unlock(&flusher_lock);
+    pthread_join(flusher, NULL);
+    flusher_running = false;
+}
+// ---------------------------------------------------------
+
+// ------- Helpers for sync and group commit ---------------
+
+// Writes back everything still in memory: held data, the blocks dirty in the cache and
+// the metadata, in that order, so metadata never points to data that is not written.
+// Does not wait for the device.
+int write_back_all() {
+    int result = 0;
+
+    if (delayed == NULL) return 0; // nothing mounted yet
+    if (commit_all_delayed() < 0) result = -1;
+    if (cache_flush() < 0) result = -1;
+    pthread_mutex_lock(&fs_lock);
+    if (flush_metadata() < 0) result = -1;
+    pthread_mutex_unlock(&fs_lock);
+    return result;
+}
+
+// Nothing else closes the disk at exit, so it is synced here too: that is what saves
+// a RAM disk to its image file
+static void write_back_at_exit() {
+    stop_flusher();
+    write_back_all();
+    disk_sync();
+}
 
-        // Initialize the file descriptor table
-        for (int i = 0; i < MAX_FILE_DESCRIPTOR; i++) {
-            file_descriptor_table[i].inode_number = -1;
-            file_descriptor_table[i].rw_pointer = -1;
+// Makes every change made before the call durable: the dirty cache blocks and metadata
+// are written and the device is synced. Requests arriving while a flush is running wait
+// for it, and the next flush, led by the first of them, covers them all - so concurrent
+// syncs share one metadata flush and one barrier. Returns -1 if a write failed.
+int group_commit() {
+    pthread_mutex_lock(&sync_lock);
+    unsigned long ticket = ++sync_requested;
+    while (sync_completed < ticket) {
+        if (sync_running) {
+            pthread_cond_wait(&sync_done, &sync_lock);
+            continue;
         }
+        // Lead a flush. It starts after every ticket handed out so far was taken, so
+        // the changes of all of them are in it.
+        unsigned long covered = sync_requested;
+        sync_running = true;
+        pthread_mutex_unlock(&sync_lock);
+
+        int result = 0;
+        if (cache_flush() < 0) result = -1;
+        pthread_mutex_lock(&fs_lock);
+        if (flush_metadata() < 0) result = -1;
+        pthread_mutex_unlock(&fs_lock);
+        if (disk_sync() < 0) result = -1;
+
+        pthread_mutex_lock(&sync_lock);
+        sync_running = false;
+        sync_completed = covered;
+        sync_result = result;
+        pthread_cond_broadcast(&sync_done);
+    }
+    int result = sync_result;
+    pthread_mutex_unlock(&sync_lock);
+    return result;
+}
+// ---------------------------------------------------------
 
-        // Add an entry in directory table and inode table for root directory
-        directory_table[0].used = 1;
-        directory_table[0].inode_number = 0;
-        strcpy(directory_table[0].filename, "");
-        inode_table[0].size = 0;
+// ------- Helpers for the disk geometry ------------------
 
-        // Initialize pointer used for the sfs_getnextfilename()
-        current_directory_filename = 0;
+// Sizes every in-memory table for the geometry in super_block. Nothing may be open:
+// the descriptors are closed here, before inode_descriptor is replaced.
+void allocate_tables() {
+    static bool descriptor_locks_ready = false;
+
+    for (int i = 0; i < MAX_FILE_DESCRIPTOR; i++) {
+        if (!descriptor_locks_ready) pthread_mutex_init(&file_descriptor_table[i].lock, NULL);
+        drop_block_map(&file_descriptor_table[i]);
+        file_descriptor_table[i].inode_number = -1;
+        file_descriptor_table[i].rw_pointer = -1;
+        reset_readahead(&file_descriptor_table[i]);
+    }
+    // Held data and metadata reach the disk at exit, before the cache (registered earlier)
+    // is flushed
+    if (!descriptor_locks_ready) atexit(write_back_at_exit);
+    descriptor_locks_ready = true;
+
+    for (int i = 0; i < inode_lock_count; i++) {
+        pthread_rwlock_destroy(&inode_locks[i]);
+        free(delayed[i].data);
+    }
+    free(delayed);
+    free(inode_locks);
+    free(inode_table);
+    free(directory_table);
+    free(free_bitmap_array);
+    free(inode_dirty_blocks);
+    free(directory_dirty_blocks);
+    free(bitmap_dirty_blocks);
+    free(directory_index);
+    free(inode_descriptor);
+    free(free_directory_entries.slots);
+    free(free_inodes.slots);
+    free(free_descriptors.slots);
+
+    inode_table = (inode*) calloc(INODE_DIR_ENTRY_LENGTH, sizeof(inode));
+    directory_table = (directoryEntry*) calloc(INODE_DIR_ENTRY_LENGTH, sizeof(directoryEntry));
+    free_bitmap_array = (uint64_t*) calloc(FREEBITMAP_WORDS, sizeof(uint64_t));
+    inode_dirty_blocks = (bool*) calloc(INODE_BLOCK_NUMBER, sizeof(bool));
+    directory_dirty_blocks = (bool*) calloc(DIRECTORY_BLOCK_NUMBER, sizeof(bool));
+    bitmap_dirty_blocks = (bool*) calloc(FREEBITMAP_BLOCKS, sizeof(bool));
+    for (directory_index_size = 1; directory_index_size < 2 * INODE_DIR_ENTRY_LENGTH; directory_index_size *= 2);
+    directory_index = (int*) malloc(directory_index_size * sizeof(int));
+    inode_descriptor = (int*) malloc(INODE_DIR_ENTRY_LENGTH * sizeof(int));
+    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) inode_descriptor[i] = -1;
+    free_directory_entries.slots = (int*) malloc(INODE_DIR_ENTRY_LENGTH * sizeof(int));
+    free_inodes.slots = (int*) malloc(INODE_DIR_ENTRY_LENGTH * sizeof(int));
+    free_descriptors.slots = (int*) malloc(MAX_FILE_DESCRIPTOR * sizeof(int));
+    free_bitmap_hint = 0;
+
+    const char *readahead_kb = getenv("SFS_READAHEAD_KB");
+    readahead_blocks = (int)((long long)(readahead_kb != NULL ? atoi(readahead_kb) : READAHEAD_DEFAULT_KB) * 1024 / BLOCK_SIZE);
+
+    const char *writeback_kb = getenv("SFS_WRITEBACK_KB");
+    writeback_blocks = (int)((long long)(writeback_kb != NULL ? atoi(writeback_kb) : WRITEBACK_DEFAULT_KB) * 1024 / BLOCK_SIZE);
+    delayed_blocks = 0;
+
+    inode_lock_count = INODE_DIR_ENTRY_LENGTH;
+    inode_locks = (pthread_rwlock_t*) malloc(inode_lock_count * sizeof(pthread_rwlock_t));
+    delayed = (delayedData*) calloc(inode_lock_count, sizeof(delayedData));
+    for (int i = 0; i < inode_lock_count; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+        delayed[i].size = -1;
+    }
+    start_flusher();
+}
+
+// Fills in the superblock for a geometry: the inode and directory tables sit after
+// the superblock, the free bitmap at the end. Returns -1 if the geometry is unusable.
+int layout_superblock(superBlock *block, const sfs_geometry *geometry) {
+    int size = geometry->block_size;
+
+    if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0 || geometry->inode_count < 1) return -1;
+    block->magic = MAGIC_GEOMETRY;
+    block->block_size = size;
+    block->file_system_size = geometry->block_count;
+    block->inode_table_length = (int)((geometry->inode_count * sizeof(inode) + size - 1) / size);
+    block->directory_table_length = (int)((geometry->inode_count * sizeof(directoryEntry) + size - 1) / size);
+    block->inode_count = geometry->inode_count;
+    block->root_directory = 0;
+
+    // Room for the superblock, both tables, the bitmap, the unused last block and some data
+    int bitmap_blocks = (int)(((geometry->block_count + 63) / 64 * 8 + size - 1) / size);
+    if (geometry->block_count < 64 || 1 + block->inode_table_length + block->directory_table_length + bitmap_blocks + 1 >= geometry->block_count) return -1;
+    return 0;
+}
+// ---------------------------------------------------------
+
+// Formats a new file system with the given geometry and mounts it
+int mksfs_with_geometry(const sfs_geometry *geometry) {
+    superBlock layout;
+
+    if (layout_superblock(&layout, geometry) < 0) {
+        printf("Invalid geometry: %d blocks of %d bytes, %d inodes\n", geometry->block_count, geometry->block_size, geometry->inode_count);
+        return -1;
+    }
+
+    // Create new file system (data held, blocks still cached and dirty metadata belong to
+    // the previous disk). The flusher stops first: the geometry it reads changes.
+    stop_flusher();
+    write_back_all();
+    super_block = layout;
+    if (init_fresh_disk(FILENAME_FOR_DISK, BLOCK_SIZE, BLOCK_NUMBER) < 0) return -1;
+    cache_mount();
+    allocate_tables();
+
+    // Initialize the free bitmap - 1 means free to use, 0 means used
+    memset(free_bitmap_array, 0xFF, FREEBITMAP_SIZE);
+    for (int i = 0; i < FREEBITMAP_WORDS * 64; i++) {
+        // occupied if superblock, inode table, dir table, free bitmap (or past the last block)
+        if (i <= INODE_BLOCK_NUMBER + DIRECTORY_BLOCK_NUMBER || i >= FREEBITMAP_START) reserve_block_FBM(i);
+    }
+
+    // Initialize the inode table (no extents: start -1, length 0)
+    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
+        inode_table[i].size = -1;
+        inode_table[i].indirect_ptr = -1;
+        inode_table[i].double_indirect_ptr = -1;
+        for (int j = 0; j < MAX_DIRECT_PTR; j++) {
+            inode_table[i].direct_ptrs[j] = (j % 2 == 0) ? -1 : 0;
+        }
+    }
+
+    // Initialize the directory table
+    for (int i = 1; i < INODE_DIR_ENTRY_LENGTH; i++) {
+        directory_table[i].used = 0; // 0 means not used, 1 means used
+        directory_table[i].inode_number = -1;
+        strcpy(directory_table[i].filename, "");
+    }
+
+    // Add an entry in directory table and inode table for root directory
+    directory_table[0].used = 1;
+    directory_table[0].inode_number = 0;
+    strcpy(directory_table[0].filename, "");
+    inode_table[0].size = 0;
+
+    // Initialize pointer used for the sfs_getnextfilename()
+    current_directory_filename = 0;
+    build_directory_index();
+    build_free_lists();
+    count_free_FBM();
+
+    // Write everything to disk (superblock, inode table, dir table, free bitmap)
+    // Plugged, so the scheduler merges the front tables into one request
+    disk_plug();
+    if (flush_superblock() < 0) printf("write_blocks(super_block) in mksfs() did not work \n");
+    mark_dirty(inode_dirty_blocks, 0, INODE_TABLE_SIZE);
+    mark_dirty(directory_dirty_blocks, 0, DIRECTORY_TABLE_SIZE);
+    mark_dirty(bitmap_dirty_blocks, 0, FREEBITMAP_SIZE);
+    if (flush_metadata() < 0) printf("write_blocks(tables) in mksfs() did not work \n");
+    if (disk_unplug() < 0) printf("disk_unplug() in mksfs() did not work \n");
+    return 0;
+}
 
-        // Write everything to disk (superblock, inode table, dir table, free bitmap)
-        if (write_blocks(0, 1, &super_block) < 0) printf("write_blocks(super_block) in mksfs() did not work \n");
-        if (write_blocks(1, INODE_BLOCK_NUMBER, &inode_table) < 0) printf("write_blocks(inode_table) in mksfs() did not work \n");
-        if (write_blocks(INODE_BLOCK_NUMBER + 1, DIRECTORY_BLOCK_NUMBER, &directory_table) < 0) printf("write_blocks(directory_table) in mksfs() did not work \n");
-        if (write_blocks(BLOCK_NUMBER - FREEBITMAP_BLOCKS - 1, FREEBITMAP_BLOCKS, &free_bitmap_array) < 0) printf("write_blocks(free_bitmap_array) in mksfs() did not work \n");
+void mksfs(int fresh) {
+    if(fresh){
+        mksfs_with_geometry(&SFS_GEOMETRY_DEFAULT);
     } else {
-        // Load existing file system
+        // Load existing file system, after writing back the data held, what the cache
+        // still holds and the metadata of the disk mounted so far. The flusher stops
+        // first: the geometry it reads changes.
+        stop_flusher();
+        write_back_all();
+
+        // The superblock gives the geometry the disk is opened with. Images older
+        // than MAGIC_GEOMETRY all have the default one.
+        superBlock label;
+        if (disk_read_label(FILENAME_FOR_DISK, &label, sizeof(label)) < 0) {
+            printf("read(super_block) in mksfs() did not work \n");
+            return;
+        }
+        if (label.magic == MAGIC || label.magic == MAGIC_EXTENTS || label.magic == MAGIC_LARGE) {
+            int magic = label.magic;
+            layout_superblock(&label, &SFS_GEOMETRY_DEFAULT);
+            label.magic = magic;
+        } else if (label.magic != MAGIC_GEOMETRY) {
+            printf("%s is not a file system image (magic %x)\n", FILENAME_FOR_DISK, label.magic);
+            return;
+        }
+        super_block = label;
         init_disk(FILENAME_FOR_DISK, BLOCK_SIZE, BLOCK_NUMBER);
+        cache_mount();
+        // Nothing is open on a freshly mounted file system
+        allocate_tables();
 
         // Initialize pointer used for the sfs_getnextfilename()
         current_directory_filename = 0;
 
-        // Load everything from disk (superblock, inode table, dir table, free bitmap)
-        if (read_blocks(0, 1, &super_block) < 0) printf("write_blocks(super_block) in mksfs() did not work \n");
-        if (read_blocks(1, INODE_BLOCK_NUMBER, &inode_table) < 0) printf("write_blocks(inode_table) in mksfs() did not work \n");
-        if (read_blocks(INODE_BLOCK_NUMBER + 1, DIRECTORY_BLOCK_NUMBER, &directory_table) < 0) printf("write_blocks(directory_table) in mksfs() did not work \n");
-        if (read_blocks(BLOCK_NUMBER - FREEBITMAP_BLOCKS - 1, FREEBITMAP_BLOCKS, &free_bitmap_array) < 0) printf("write_blocks(free_bitmap_array) in mksfs() did not work \n");
+        // Load everything from disk (inode table, dir table, free bitmap)
+        // Older images keep their inode table in the legacy layout until it is converted below
+        bool legacy = super_block.magic == MAGIC || super_block.magic == MAGIC_EXTENTS;
+        legacyInode *legacy_table = legacy ? (legacyInode*) malloc(INODE_DIR_ENTRY_LENGTH * sizeof(legacyInode)) : NULL;
+        if (load_table(INODE_TABLE_START, legacy ? (void *)legacy_table : (void *)inode_table, legacy ? INODE_DIR_ENTRY_LENGTH * sizeof(legacyInode) : INODE_TABLE_SIZE, INODE_BLOCK_NUMBER) < 0) printf("write_blocks(inode_table) in mksfs() did not work \n");
+        if (load_table(DIRECTORY_START, directory_table, DIRECTORY_TABLE_SIZE, DIRECTORY_BLOCK_NUMBER) < 0) printf("write_blocks(directory_table) in mksfs() did not work \n");
+        // MAGIC images keep one int per block there, converted to the packed bitmap
+        if (super_block.magic != MAGIC || load_legacy_bitmap() < 0) {
+            if (load_table(FREEBITMAP_START, free_bitmap_array, FREEBITMAP_SIZE, FREEBITMAP_BLOCKS) < 0) printf("write_blocks(free_bitmap_array) in mksfs() did not work \n");
+        }
+
+        // Compat path: an image with the older inode layouts is converted once, and
+        // older superblocks are rewritten with the geometry they imply. The tables, the
+        // whole bitmap in the packed format among them, go to the disk before the new magic.
+        if (legacy) {
+            reserve_legacy_blocks(legacy_table, super_block.magic);
+            migrate_legacy_inodes(legacy_table, super_block.magic);
+            free(legacy_table);
+        }
+        if (super_block.magic != MAGIC_GEOMETRY) {
+            super_block.magic = MAGIC_GEOMETRY;
+            mark_dirty(bitmap_dirty_blocks, 0, FREEBITMAP_SIZE);
+            if (flush_metadata() < 0 || flush_superblock() < 0) printf("Error: could not upgrade the file system\n");
+        }
+        build_directory_index();
+        build_free_lists();
+        count_free_FBM();
     }
 }
 
@@ -157,388 +1279,678 @@ int sfs_fopen(char *name) {
 		return -1;
 	}
 
-    // Check if the file exists in the directory table
-    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
-        if (strcmp(directory_table[i].filename, name) == 0) {
-            // Check if the file is already opened in the file descriptor table and return the index if it is
-            for (int j = 0; j < MAX_FILE_DESCRIPTOR; j++) {
-                if (file_descriptor_table[j].inode_number == directory_table[i].inode_number) {
-                    // Append mode
-                    file_descriptor_table[j].rw_pointer = inode_table[directory_table[i].inode_number].size;
-                    return j;
-                }
-            }
-            // File exists but is not present in the file descriptor table so we create a new entry in the file descriptor table
-            for (int j = 0; j < MAX_FILE_DESCRIPTOR; j++) {
-                if (file_descriptor_table[j].inode_number == -1) {
-                    file_descriptor_table[j].inode_number = directory_table[i].inode_number;
-                    file_descriptor_table[j].rw_pointer = inode_table[directory_table[i].inode_number].size;;
-                    return j;
-                }
-            }
+    pthread_mutex_lock(&fs_lock);
+
+    // Check if the file exists in the directory table (through the index)
+    int existing = find_directory_entry(name);
+    if (existing != -1) {
+        int inode_number = directory_table[existing].inode_number;
+        // Check if the file is already opened in the file descriptor table and return the index if it is
+        int open_fd = inode_descriptor[inode_number];
+        if (open_fd != -1) {
+            pthread_mutex_unlock(&fs_lock);
+            // Append mode - the cursor moves under the inode and descriptor locks
+            sfs_fseek(open_fd, INT64_MAX);
+            return open_fd;
+        }
+        // File exists but is not present in the file descriptor table so we create a new entry in the file descriptor table
+        int fd = pop_free_slot(&free_descriptors);
+        if (fd == -1) {
+            pthread_mutex_unlock(&fs_lock);
+            printf("No available file descriptor found - please close some files and try again\n");
+            return -1;
         }
+        file_descriptor_table[fd].inode_number = inode_number;
+        file_descriptor_table[fd].rw_pointer = file_size(inode_number);
+        inode_descriptor[inode_number] = fd;
+        pthread_mutex_unlock(&fs_lock);
+        return fd;
     }
 
     // File does not exist, so we create a new file...
 
-    // Check if there is space in the directory table
-    int dirEntry = -1;
-    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
-        if (directory_table[i].inode_number == -1) {
-            dirEntry = i;
-            break;
-        }
-    }
-
-    if (dirEntry == -1) {
+    // Check if there is space in the directory table, the inode table and the file
+    // descriptor table - nothing is taken unless all three have a free slot
+    if (free_directory_entries.count == 0) {
+        pthread_mutex_unlock(&fs_lock);
         printf("No available directory entry found - remove some files?\n");
         return -1;
     }
-    
-    // check if there is space in the inode table
-    int inodeEntry = -1;
-    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
-        if (inode_table[i].size == -1) {
-            inodeEntry = i;
-            break;
-        }
-    }
-
-    if (inodeEntry == -1) {
+    if (free_inodes.count == 0) {
+        pthread_mutex_unlock(&fs_lock);
         printf("No available inode found - remove some files?\n");
         return -1;
     }
+    if (free_descriptors.count == 0) {
+        pthread_mutex_unlock(&fs_lock);
+        printf("No available file descriptor found - please close some files and try again\n");
+        return -1;
+    }
+    int dirEntry = pop_free_slot(&free_directory_entries);
+    int inodeEntry = pop_free_slot(&free_inodes);
 
     // Create inode and directory entry for the new file
     inode_table[inodeEntry].size = 0;
     directory_table[dirEntry].inode_number = inodeEntry;
     strcpy(directory_table[dirEntry].filename, name);
     directory_table[dirEntry].used = 1;
-
-    // Write to disk that a new inode and directory entry has been created - maybe not necessary?
-    if (write_blocks(1, INODE_BLOCK_NUMBER, &inode_table) < 0) printf("write_blocks(inode_table) in sfs_fopen() did not work\n");
-    if (write_blocks(INODE_BLOCK_NUMBER + 1, DIRECTORY_BLOCK_NUMBER, &directory_table) < 0) printf("write_blocks(directory_table) in sfs_fopen() did not work\n");
-
-    // Add to file descriptor table (open the file) if there is space
-    for (int i = 0; i < MAX_FILE_DESCRIPTOR; i++) {
-        if (file_descriptor_table[i].inode_number == -1) {
-            file_descriptor_table[i].inode_number = inodeEntry;
-            file_descriptor_table[i].rw_pointer = 0;
-            return i;
-        }
-    }
-    printf("File created but no available file descriptor found - please close some files and try again\n");
-    return -1;
+    index_directory_entry(dirEntry);
+
+    // The blocks holding the new inode and directory entry are written back on the next
+    // sfs_fclose, sync or unmount
+    mark_inode_dirty(inodeEntry);
+    mark_directory_dirty(dirEntry);
+
+    // Add to file descriptor table (open the file)
+    int fd = pop_free_slot(&free_descriptors);
+    file_descriptor_table[fd].inode_number = inodeEntry;
+    file_descriptor_table[fd].rw_pointer = 0;
+    inode_descriptor[inodeEntry] = fd;
+    pthread_mutex_unlock(&fs_lock);
+    return fd;
 }
 
 int sfs_fclose(int fileID) {
-    // Check if file exists and close it if it does, else give an error
-	if (file_descriptor_table[fileID].inode_number == -1) { 
+    // Check if file exists and close it if it does, else give an error.
+    // Exclusive, so no read or write on the descriptor is still running.
+    int inode_number = lock_descriptor_inode(fileID, true);
+	if (inode_number == -1) { 
         printf("Error closing file: No file associated with that fileID\n");
         return -1; 
     } else {
-		file_descriptor_table[fileID].inode_number = -1;
-		file_descriptor_table[fileID].rw_pointer = -1;
-		return 0;	
+		// Data held back from allocation gets its blocks now. If they cannot be
+		// written the data stays held for a later commit and the close reports it.
+		int result = commit_delayed(inode_number);
+		pthread_mutex_lock(&fs_lock);
+		release_descriptor(&file_descriptor_table[fileID]);
+		pthread_mutex_unlock(&fs_lock);
+		pthread_rwlock_unlock(&inode_locks[inode_number]);
+		// Data blocks written through the cache, then the metadata, reach the disk now
+		// (they are only durable after sfs_fsync)
+		cache_flush();
+		pthread_mutex_lock(&fs_lock);
+		if (flush_metadata() < 0) {
+			printf("Error: cannot write block\n");
+			result = -1;
+		}
+		pthread_mutex_unlock(&fs_lock);
+		return result;
 	}
 }
 
-int sfs_fwrite(int fileID, const char *buf, int length) {
-
-    if(file_descriptor_table[fileID].inode_number == -1){
-        printf("Can't write to a file that's not opened!\n");
+// Writes length bytes at rw_pointer into the file open as fileID, whose inode the caller
+// holds exclusively, allocating blocks for them right away. A write that starts past the
+// end of the file fills the gap with zeros. Returns length, or -1 if the disk is full or
+// the blocks could not be written.
+int write_through(int fileID, int inode_number, const char *buf, int length, int64_t rw_pointer) {
+    // Files grow until the disk or the extent tree is full
+    if (length <= 0) return 0;
+    if (beyond_block_range(rw_pointer, length)) {
+        printf("Error allocating blocks - not enough space, sorry!\n");
         return -1;
     }
 
-    // Make sure that we're not writing too much (truncate if needed)
-    int rw_pointer = file_descriptor_table[fileID].rw_pointer;
-    if(length + rw_pointer > MAX_FILE_SIZE) length = MAX_FILE_SIZE - rw_pointer;
-
-    int indirect_pointers_array[BLOCK_SIZE/sizeof(int)]; // Array for indirect pointer
-    int first_write_block = rw_pointer / BLOCK_SIZE; // First block that will be written into
-    int last_write_block = (rw_pointer + length) / BLOCK_SIZE; // Last block that will be written into
-    int amt_written = 0; // For return, keeps track of how much is written
-
     // Get current inode
-    int inode_number = file_descriptor_table[fileID].inode_number;
     inode *inode = &inode_table[inode_number];
 
-    // Create a temp block buffer to read what is inside the block
-    void* temp_block = (void*) malloc(BLOCK_SIZE);
-    // Boolean for indirect pointer
-    bool bool_for_indirect_pointers_array = false;
-    
-    for (int i = first_write_block; i <= last_write_block; i++) {
-        // Calculate the offset for what's written in the block, the amount left in the block, and how much bytes we can write in the current block
-        int offset = (i == first_write_block) ? rw_pointer % BLOCK_SIZE : 0;
-        int block_size = (i == last_write_block) ? (rw_pointer + length) % BLOCK_SIZE : BLOCK_SIZE;
-        int bytes_written = block_size - offset;
-
-        if (i < MAX_DIRECT_PTR) {
-            // Allocate block if neccesary
-            if(inode->direct_ptrs[i] == -1) {
-                int allocatedBlock = allocate_block_FBM();
-                if (allocatedBlock < 0) {
-                    printf("Error allocating blocks - not enough space, sorry!\n");
-                    return -1;
-                }
-                inode->direct_ptrs[i] = allocatedBlock;
-            }
+    // Bytes from the end of the file up to rw_pointer are written as zeros
+    int64_t gap_start = (rw_pointer > inode->size) ? inode->size : rw_pointer;
+    char* zero_block = NULL;
+
+    int first_write_block = (int)(gap_start / BLOCK_SIZE); // First block that will be written into
+    int last_write_block = (int)((rw_pointer + length - 1) / BLOCK_SIZE); // Last block that will be written into
+    int block_count = last_write_block - first_write_block + 1;
 
-            // Read the block and write into it
-            read_blocks(inode->direct_ptrs[i], 1, temp_block);
+    // Grow the file to cover the write, in contiguous runs where the disk allows it.
+    // The extents are only looked at when the write goes past the mapped blocks.
+    fileDescriptorEntry* file_descriptor_entry = &file_descriptor_table[fileID];
+    file_block_map(file_descriptor_entry);
+    if (last_write_block >= file_descriptor_entry->block_map_length) {
+        pthread_mutex_lock(&fs_lock);
+        int extent_count;
+        extent *extents = load_extents(inode, &extent_count);
+        // Blocks promised to data held for other files are not for taking (nor is room
+        // for this file's extent blocks while there are promises)
+        int blocks_needed = last_write_block + 1;
+        if (reserved_blocks > 0) {
+            int available = free_block_count - reserved_blocks - 3;
+            int have = file_descriptor_entry->block_map_length;
+            if (blocks_needed - have > available) blocks_needed = have + (available > 0 ? available : 0);
+        }
+        bool grown = grow_extents(&extents, &extent_count, blocks_needed) >= 0 && blocks_needed == last_write_block + 1;
+        if (store_extents(inode, inode_number, extents, extent_count) < 0) grown = false;
+        free(extents);
+        // The extents changed - the descriptor (sfs_fopen opens one per file) reloads its map
+        drop_block_map(file_descriptor_entry);
+        if (!grown) {
+            pthread_mutex_unlock(&fs_lock);
+            printf("Error allocating blocks - not enough space, sorry!\n");
+            return -1;
+        }
+        pthread_mutex_unlock(&fs_lock);
+    }
 
-            memcpy(temp_block + offset, buf + amt_written, bytes_written);
+    // Physical block behind each block the write touches, in file order
+    int* physical_blocks = file_block_map(file_descriptor_entry) + first_write_block;
+    // Blocks the write covers entirely go to the disk straight from buf
+    block_iovec* direct_vector = (block_iovec*) malloc(block_count * sizeof(block_iovec));
+    int direct_count = 0;
+    // At most three blocks are only partly covered - the first, the one where a gap
+    // ends and the data starts, and the last. They are merged with what the file holds
+    // through the cache
+    char* edge_blocks = (char*) malloc(3 * BLOCK_SIZE);
+    block_iovec edge_vector[3];
+    int64_t edge_start[3]; // file offset of each edge block
+    block_iovec read_vector[3];
+    int edge_count = 0, read_count = 0;
+    int64_t write_end = rw_pointer + length;
+
+    for (int i = 0; i < block_count; i++) {
+        int64_t block_start = (int64_t)(first_write_block + i) * BLOCK_SIZE;
+        int64_t block_end = block_start + BLOCK_SIZE;
+        bool all_data = block_start >= rw_pointer && block_end <= write_end;
+        bool all_gap = block_start >= gap_start && block_end <= rw_pointer;
+
+        if (all_data || all_gap) {
+            // Any cached copy is stale now, and must not be written back over the new data
+            cache_discard(physical_blocks[i]);
+            if (all_gap && zero_block == NULL) zero_block = (char*) calloc(1, BLOCK_SIZE);
+            direct_vector[direct_count].block = physical_blocks[i];
+            direct_vector[direct_count].buffer = all_data ? (char *)buf + (block_start - rw_pointer) : zero_block;
+            direct_count++;
+            continue;
+        }
 
-            write_blocks(inode->direct_ptrs[i], 1, temp_block);
+        char *edge = edge_blocks + edge_count * BLOCK_SIZE;
+        edge_vector[edge_count].block = physical_blocks[i];
+        edge_vector[edge_count].buffer = edge;
+        edge_start[edge_count] = block_start;
+        edge_count++;
+
+        // The old contents only matter for bytes the write leaves alone that are part of
+        // the file: before gap_start, or after the write but before the end of the file.
+        // Blocks past the end of the file (freshly allocated ones) are not read at all.
+        bool keeps_head = block_start < gap_start;
+        bool keeps_tail = block_start + BLOCK_SIZE > write_end && write_end < inode->size;
+        if (keeps_head || keeps_tail) {
+            read_vector[read_count].block = physical_blocks[i];
+            read_vector[read_count].buffer = edge;
+            read_count++;
         } else {
-            // It falls into the indirect pointers
-            bool_for_indirect_pointers_array = true;
-            if (inode->indirect_ptr == -1) {
-                // Allocate block if necessary
-                if(inode->indirect_ptr == -1) {
-                    int allocatedBlock = allocate_block_FBM();
-                    if (allocatedBlock < 0) {
-                        printf("Error allocating blocks - not enough space, sorry!\n");
-                        return -1;
-                    }
-                    inode->indirect_ptr = allocatedBlock;
-                }
+            memset(edge, 0, BLOCK_SIZE);
+        }
+    }
 
-                for (int i = 0; i < BLOCK_SIZE/sizeof(int); i++) {
-                    indirect_pointers_array[i] = -1;
-                }
+    // Read the partial blocks that need it (from the cache if they are there), lay the
+    // new data over them and leave them dirty in the cache until it is flushed
+    if (read_count > 0) cache_read_v(read_vector, read_count);
+    for (int i = 0; i < edge_count; i++) {
+        int64_t block_start = edge_start[i];
+        int64_t block_end = block_start + BLOCK_SIZE;
+        int64_t from = (block_start > gap_start) ? block_start : gap_start;
+        int64_t to = (block_end < rw_pointer) ? block_end : rw_pointer;
+        if (to > from) memset((char *)edge_vector[i].buffer + (from - block_start), 0, to - from);
+        from = (block_start > rw_pointer) ? block_start : rw_pointer;
+        to = (block_end < write_end) ? block_end : write_end;
+        if (to > from) memcpy((char *)edge_vector[i].buffer + (from - block_start), buf + (from - rw_pointer), to - from);
+    }
+    if (edge_count > 0) cache_write_v(edge_vector, edge_count);
 
-                // Write into the block
-                memcpy(temp_block, indirect_pointers_array, BLOCK_SIZE);
-                write_blocks(inode->indirect_ptr, 1, temp_block);
-            }
+    // Whole blocks: adjacent ones are merged into multi-block requests. If they do not
+    // reach the disk the write fails and the file keeps its size.
+    bool written = direct_count == 0 || write_blocks_v(direct_vector, direct_count) >= 0;
+    if (!written) {
+        printf("Error: cannot write block\n");
+    } else {
+        // Modify the file size in the inode table
+        pthread_mutex_lock(&fs_lock);
+        if (write_end > inode->size) inode->size = write_end;
+        mark_inode_dirty(inode_number);
+        pthread_mutex_unlock(&fs_lock);
+    }
 
-            // Read the indirect pointer block 
-            read_blocks(inode->indirect_ptr, 1, temp_block);
+    free(zero_block);
+    free(edge_blocks);
+    free(direct_vector);
+    return written ? length : -1;
+}
 
-            // Copy content of the indirect block into the array
-            memcpy(indirect_pointers_array, temp_block, BLOCK_SIZE);
+// Holds bytes [offset, offset + length) of a file, all past the blocks it has on disk,
+// in memory (zeros in front of offset up to what is held). first is the first block
+// not on disk. Returns -1, holding nothing new, if the disk has no room to promise.
+// The caller has checked the range with beyond_block_range().
+int hold_range(int inode_number, int first, const char *buf, int length, int64_t offset) {
+    delayedData *d = &delayed[inode_number];
+    int blocks = (int)((offset + length - 1) / BLOCK_SIZE) + 1 - first;
+
+    // More than the disk has could never be promised
+    if (blocks > BLOCK_NUMBER) return -1;
+    if (blocks > d->block_count) {
+        // Promise free blocks for the held data as it grows
+        pthread_mutex_lock(&fs_lock);
+        int more = reservation_for(blocks) - d->reserved;
+        bool room = free_block_count - reserved_blocks >= more;
+        if (room) {
+            reserved_blocks += more;
+            d->reserved += more;
+            delayed_blocks += blocks - d->block_count;
+        }
+        pthread_mutex_unlock(&fs_lock);
+        if (!room) return -1;
+
+        if (blocks > d->capacity) {
+            int capacity = (d->capacity > 0) ? d->capacity : 16;
+            while (capacity < blocks) capacity *= 2;
+            d->data = (char*) realloc(d->data, (size_t)capacity * BLOCK_SIZE);
+            d->capacity = capacity;
+        }
+        memset(d->data + (size_t)d->block_count * BLOCK_SIZE, 0, (size_t)(blocks - d->block_count) * BLOCK_SIZE);
+        d->block_count = blocks;
+    }
+    memcpy(d->data + (offset - (int64_t)first * BLOCK_SIZE), buf, length);
 
-            // Check if the indirect block at (i - 12) is uninitialized
-            if (indirect_pointers_array[i - 12] == -1) { 
-                int allocatedBlock = allocate_block_FBM();
-                if (allocatedBlock < 0) {
-                    printf("Error allocating blocks - not enough space, sorry!\n");
-                    return -1;
-                }
-                indirect_pointers_array[i - 12] = allocatedBlock;
-            }
+    pthread_mutex_lock(&fs_lock);
+    if (d->size < 0) {
+        d->first_block = first;
+        d->size = inode_table[inode_number].size;
+        clock_gettime(CLOCK_MONOTONIC, &d->since);
+    }
+    if (offset + length > d->size) d->size = offset + length;
+    pthread_mutex_unlock(&fs_lock);
+    return length;
+}
 
-            // Read the block and write into it
-            read_blocks(indirect_pointers_array[i - 12], 1, temp_block);
-            memcpy(temp_block + offset, buf + amt_written, bytes_written);
-            write_blocks(indirect_pointers_array[i - 12], 1, temp_block);
-        }
+// Writes length bytes at rw_pointer into the file open as fileID, whose inode the caller
+// holds exclusively. Bytes in blocks the file has on disk are written in place; bytes past
+// them are held in memory and only get blocks when committed - on sfs_fclose, when the
+// held data goes over its budget or its deadline, or when the disk is nearly full.
+// Leaves the descriptor's cursor alone. Returns length, or -1 if the disk is full - or
+// the bytes written in place, when only the held part found no room.
+int write_range(int fileID, int inode_number, const char *buf, int length, int64_t rw_pointer) {
+    if (length <= 0) return 0;
+    if (beyond_block_range(rw_pointer, length)) {
+        printf("Error allocating blocks - not enough space, sorry!\n");
+        return -1;
+    }
+    if (writeback_blocks <= 0) return write_through(fileID, inode_number, buf, length, rw_pointer);
+
+    delayedData *d = &delayed[inode_number];
+    int64_t size = file_size(inode_number);
+    // Where the blocks on disk end
+    int first_held = d->first_block;
+    if (d->size < 0) {
+        file_block_map(&file_descriptor_table[fileID]);
+        first_held = file_descriptor_table[fileID].block_map_length;
+    }
+    int64_t mapped_end = (int64_t)first_held * BLOCK_SIZE;
+    int64_t write_end = rw_pointer + length;
+
+    // In place: the part of the write in blocks on disk. A gap in front of a write past
+    // them is zeroed up to the end of the last block on disk.
+    if (rw_pointer < mapped_end) {
+        int in_place = (int)((write_end < mapped_end ? write_end : mapped_end) - rw_pointer);
+        if (write_through(fileID, inode_number, buf, in_place, rw_pointer) < 0) return -1;
+    } else if (size < mapped_end) {
+        char *zeros = (char*) calloc(1, mapped_end - size);
+        int zeroed = write_through(fileID, inode_number, zeros, (int)(mapped_end - size), size);
+        free(zeros);
+        if (zeroed < 0) return -1;
+    }
+    if (write_end <= mapped_end) return length;
+
+    // Held: the rest. With no room left to promise, what is held is committed and the
+    // rest written through, to fail there if the disk is full.
+    int64_t held_from = (rw_pointer > mapped_end) ? rw_pointer : mapped_end;
+    const char *held_buf = buf + (held_from - rw_pointer);
+    int held_length = (int)(write_end - held_from);
+    if (hold_range(inode_number, first_held, held_buf, held_length, held_from) < 0) {
+        int in_place = (rw_pointer < mapped_end) ? (int)(mapped_end - rw_pointer) : -1;
+        if (commit_delayed(inode_number) < 0) return in_place;
+        if (write_through(fileID, inode_number, held_buf, held_length, held_from) < 0) return in_place;
+        return length;
+    }
 
-        amt_written += bytes_written;
-        
+    // Over budget, or held too long: commit this file's data now
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long age_ms = (now.tv_sec - d->since.tv_sec) * 1000 + (now.tv_nsec - d->since.tv_nsec) / 1000000;
+    pthread_mutex_lock(&fs_lock);
+    bool over_budget = delayed_blocks > writeback_blocks;
+    pthread_mutex_unlock(&fs_lock);
+    if (over_budget || age_ms >= WRITEBACK_DEADLINE_MS) {
+        if (commit_delayed(inode_number) < 0) return -1;
     }
+    // Other files' expired data is the flusher's: scanning every inode here would
+    // cost each write a lock per inode
+    return length;
+}
 
-    // If we wrote into the indirect pointer, then we need to update accordingly
-    if (bool_for_indirect_pointers_array) {
-        memcpy(temp_block, indirect_pointers_array, BLOCK_SIZE);
-        write_blocks(inode->indirect_ptr, 1, temp_block);
+int sfs_fwrite(int fileID, const char *buf, int length) {
+
+    // Writers have the file to themselves
+    int inode_number = lock_descriptor_inode(fileID, true);
+    if(inode_number == -1){
+        printf("Can't write to a file that's not opened!\n");
+        return -1;
     }
 
-    // Modify the rw_pointer and file size in the file descriptor table and the inode table
+    // Write at the cursor and move it past what was written
     fileDescriptorEntry* file_descriptor_entry = &file_descriptor_table[fileID];
-    file_descriptor_entry->rw_pointer += length;
-    if (file_descriptor_entry->rw_pointer > inode->size) inode->size = file_descriptor_entry->rw_pointer;
+    int written = write_range(fileID, inode_number, buf, length, file_descriptor_entry->rw_pointer);
+    if (written > 0) file_descriptor_entry->rw_pointer += written;
 
-    // Update free bitmap and inode table - FLUSH
-    if (write_blocks(BLOCK_NUMBER - FREEBITMAP_BLOCKS -1, FREEBITMAP_BLOCKS, &free_bitmap_array) > 0 && write_blocks(1, INODE_BLOCK_NUMBER, &inode_table) > 0) {
-        free(temp_block);
-        return amt_written;
-    } else {
-        printf("Error: cannot write block\n");
-        free(temp_block);
-        return amt_written;
-    }
+    pthread_rwlock_unlock(&inode_locks[inode_number]);
+    return written;
 }
 
-int sfs_fread(int fileID, char *buf, int length) {
+int sfs_pwrite(int fileID, const char *buf, int length, long long offset) {
 
-    if(file_descriptor_table[fileID].inode_number == -1){
+    // Writers have the file to themselves - the descriptor's cursor is not used
+    int inode_number = lock_descriptor_inode(fileID, true);
+    if(inode_number == -1){
         printf("Can't write to a file that's not opened!\n");
         return -1;
     }
+    if (offset < 0) {
+        pthread_rwlock_unlock(&inode_locks[inode_number]);
+        return -1;
+    }
 
-    // Get current inode
-    int inode_number = file_descriptor_table[fileID].inode_number;
-    inode *inode = &inode_table[inode_number];
-
-    // If we're reading more than the file size, change length to file size
-    int rw_pointer = file_descriptor_table[fileID].rw_pointer;
-    if (rw_pointer + length > inode->size) length = inode->size;
+    int written = write_range(fileID, inode_number, buf, length, offset);
 
-    int first_read_block = rw_pointer / BLOCK_SIZE; // First block that will be read
-    int last_read_block = (rw_pointer + length) / BLOCK_SIZE; // Last block that will be written into
-    int amt_written = 0; // For return, keeps track of how much is written
+    pthread_rwlock_unlock(&inode_locks[inode_number]);
+    return written;
+}
 
-    // Create a temp block buffer to read what is inside the block
-    void* temp_block = (void*) malloc(BLOCK_SIZE);
+// Reads length bytes of a file from rw_pointer, translating them through its block map.
+// The caller holds the inode (shared is enough) and has clamped the range to the file.
+// The ahead_count blocks from file block ahead_first are read into the cache with them.
+// Blocks held for the file come from memory, mapped or not: a commit whose write
+// failed leaves the data held over blocks it allocated.
+void read_range(int* block_map, int block_map_length, const delayedData *held, char *buf, int length,
+        int64_t rw_pointer, int ahead_first, int ahead_count) {
+    int first_read_block = (int)(rw_pointer / BLOCK_SIZE); // First block that will be read
+    int last_read_block = (int)((rw_pointer + length - 1) / BLOCK_SIZE); // Last block that will be read
+    int block_count = 0;
+
+    // Whole blocks are read straight into buf, the partial first and last block go
+    // through edge buffers
+    char* edge_blocks = (char*) malloc(2 * BLOCK_SIZE);
+    block_iovec* block_vector = (block_iovec*) malloc((last_read_block - first_read_block + 1) * sizeof(block_iovec));
 
     for (int i = first_read_block; i <= last_read_block; i++) {
-        // Calculate the offset for what's read in the block, the amount left in the block to read, and how much bytes we can read in the current block
-        int offset = (i == first_read_block) ? rw_pointer % BLOCK_SIZE : 0;
-        int block_size = (i == last_read_block) ? (rw_pointer + length) % BLOCK_SIZE : BLOCK_SIZE;
-        int bytes_read = block_size - offset;
+        int block_start = (int)((int64_t)i * BLOCK_SIZE - rw_pointer); // Where the block lands in buf (negative if it starts before rw_pointer)
+        int block = (i < block_map_length) ? block_map[i] : -1;
+        char *dest;
 
-        // If inside direct or indirect
-        if (i < MAX_DIRECT_PTR) {
+        if (block_start >= 0 && block_start + BLOCK_SIZE <= length) dest = buf + block_start;
+        else if (i == first_read_block) dest = edge_blocks;
+        else dest = edge_blocks + BLOCK_SIZE;
 
-            read_blocks(inode->direct_ptrs[i], 1, temp_block);
-            memcpy(buf + amt_written, temp_block + offset, bytes_read);
+        if (held->size >= 0 && i >= held->first_block && i < held->first_block + held->block_count) {
+            // Held in memory
+            memcpy(dest, held->data + (size_t)(i - held->first_block) * BLOCK_SIZE, BLOCK_SIZE);
+            continue;
+        }
+        if (block == -1) {
+            // Never written - reads back as zeros
+            memset(dest, 0, BLOCK_SIZE);
+            continue;
+        }
+        block_vector[block_count].block = block;
+        block_vector[block_count].buffer = dest;
+        block_count++;
+    }
 
-        } else {
-            // It falls into the indirect pointers
-            int indirect_pointers_array[BLOCK_SIZE/sizeof(int)];
+    // Readahead blocks, already clamped to the block map
+    int* ahead = (int*) malloc((ahead_count > 0 ? ahead_count : 1) * sizeof(int));
+    for (int i = 0; i < ahead_count; i++) ahead[i] = block_map[ahead_first + i];
 
-            read_blocks(inode->indirect_ptr, 1, temp_block);
-            memcpy(indirect_pointers_array, temp_block, BLOCK_SIZE);
+    // One call for the whole range and the readahead - cached blocks are copied,
+    // adjacent misses are merged into single requests
+    cache_read_ahead_v(block_vector, block_count, ahead, ahead_count);
+    free(ahead);
 
-            read_blocks(indirect_pointers_array[i - 12], 1, temp_block);
-            memcpy(buf + amt_written, temp_block + offset, bytes_read);
-        }
+    // Copy out the parts of the edge blocks that were asked for
+    int offset = (int)(rw_pointer % BLOCK_SIZE);
+    if (offset != 0 || length < BLOCK_SIZE) {
+        int bytes_read = (BLOCK_SIZE - offset < length) ? BLOCK_SIZE - offset : length;
+        memcpy(buf, edge_blocks + offset, bytes_read);
+    }
+    int last_block_start = (int)((int64_t)last_read_block * BLOCK_SIZE - rw_pointer);
+    if (last_read_block != first_read_block && length - last_block_start < BLOCK_SIZE) {
+        memcpy(buf + last_block_start, edge_blocks + BLOCK_SIZE, length - last_block_start);
+    }
+
+    free(block_vector);
+    free(edge_blocks);
+}
+
+int sfs_fread(int fileID, char *buf, int length) {
+
+    // Readers share the file
+    int inode_number = lock_descriptor_inode(fileID, false);
+    if(inode_number == -1){
+        printf("Can't write to a file that's not opened!\n");
+        return -1;
+    }
+
+    fileDescriptorEntry* file_descriptor_entry = &file_descriptor_table[fileID];
+
+    // Take the range from the cursor and move it past, so readers sharing the descriptor
+    // get consecutive ranges. If we're reading past the end of the file, stop at the end of the file
+    pthread_mutex_lock(&file_descriptor_entry->lock);
+    int64_t rw_pointer = file_descriptor_entry->rw_pointer;
+    int64_t size = file_size(inode_number);
+    if (rw_pointer + length > size) length = (int)(size - rw_pointer);
+    if (length > 0) file_descriptor_entry->rw_pointer += length;
+    // Translate the range through the block map of the open file
+    int* block_map = file_block_map(file_descriptor_entry);
+    int block_map_length = file_descriptor_entry->block_map_length;
+    int ahead_first = 0, ahead_count = 0;
+    if (length > 0) plan_readahead(file_descriptor_entry, rw_pointer, length, size, &ahead_first, &ahead_count);
+    pthread_mutex_unlock(&file_descriptor_entry->lock);
+
+    if (length > 0) read_range(block_map, block_map_length, &delayed[inode_number], buf, length, rw_pointer, ahead_first, ahead_count);
+    pthread_rwlock_unlock(&inode_locks[inode_number]);
+    return (length > 0) ? length : 0;
+}
 
-        amt_written += bytes_read;
+int sfs_pread(int fileID, char *buf, int length, long long offset) {
+
+    // Readers share the file - the descriptor's cursor is not used
+    int inode_number = lock_descriptor_inode(fileID, false);
+    if(inode_number == -1){
+        printf("Can't read from a file that's not opened!\n");
+        return -1;
+    }
+    if (offset < 0) {
+        pthread_rwlock_unlock(&inode_locks[inode_number]);
+        return -1;
     }
 
-    // Modify the rw_pointer in the file descriptor table
-    file_descriptor_table[fileID].rw_pointer += length;
+    // If we're reading past the end of the file, stop at the end of the file
+    int64_t size = file_size(inode_number);
+    if (offset + length > size) length = (offset < size) ? (int)(size - offset) : 0;
 
-    free(temp_block);
-    
-    return amt_written;
+    fileDescriptorEntry* file_descriptor_entry = &file_descriptor_table[fileID];
+    pthread_mutex_lock(&file_descriptor_entry->lock);
+    int* block_map = file_block_map(file_descriptor_entry);
+    int block_map_length = file_descriptor_entry->block_map_length;
+    int ahead_first = 0, ahead_count = 0;
+    if (length > 0) plan_readahead(file_descriptor_entry, offset, length, size, &ahead_first, &ahead_count);
+    pthread_mutex_unlock(&file_descriptor_entry->lock);
+
+    if (length > 0) read_range(block_map, block_map_length, &delayed[inode_number], buf, length, offset, ahead_first, ahead_count);
+    pthread_rwlock_unlock(&inode_locks[inode_number]);
+    return (length > 0) ? length : 0;
 }
 
-int sfs_fseek(int fileID, int offset) {
+int sfs_fseek(int fileID, long long offset) {
     // Check if file is open first (can't seek if file is not open)
-    if (file_descriptor_table[fileID].inode_number == -1) {
+    int inode_number = lock_descriptor_inode(fileID, false);
+    if (inode_number == -1) {
         printf("File is not open. Please open before using sfs_fseek()!\n");
         return -1;
     } else {
+        fileDescriptorEntry* file_descriptor_entry = &file_descriptor_table[fileID];
+        pthread_mutex_lock(&file_descriptor_entry->lock);
         if (offset >= 0) {
             // Set the read/write pointer based on the specified offset
             // If offset is greater than the file size, set the rw pointer to the end of the file
             // else set it to the offset
-            file_descriptor_table[fileID].rw_pointer = (offset > inode_table[fileID].size) ? inode_table[fileID].size : offset;
+            int64_t size = file_size(inode_number);
+            file_descriptor_entry->rw_pointer = (offset > size) ? size : offset;
         } else {
             // Set the rw pointer to the beginning of the file if offset is negative
-            file_descriptor_table[fileID].rw_pointer = 0;
+            file_descriptor_entry->rw_pointer = 0;
         }
+        pthread_mutex_unlock(&file_descriptor_entry->lock);
+        pthread_rwlock_unlock(&inode_locks[inode_number]);
         return 0;
     }
 }
 
-int sfs_remove(char *file) {
-    int inode_number = -1;
+int sfs_fsync(int fileID) {
+    // Exclusive, so nothing is added to the data held for the file while it gets its blocks
+    int inode_number = lock_descriptor_inode(fileID, true);
+    if (inode_number == -1) {
+        printf("Error syncing file: No file associated with that fileID\n");
+        return -1;
+    }
+    int result = commit_delayed(inode_number);
+    pthread_rwlock_unlock(&inode_locks[inode_number]);
 
-    // Get the inode number of the file
-    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
-        if (strcmp(file, directory_table[i].filename) != 0) continue;
-        inode_number = directory_table[i].inode_number;
+    // The cache and the tables are shared, so the flush covers other files' changes too,
+    // and is shared with every sync made meanwhile
+    if (group_commit() < 0) result = -1;
+    return result;
+}
+
+int sfs_sync() {
+    int result = commit_all_delayed();
+
+    if (group_commit() < 0) result = -1;
+    return result;
+}
+
+int sfs_remove(char *file) {
+    // Get the directory entry and inode number of the file, then wait for the file to
+    // be idle. Look again once it is: it may have been removed (or replaced) meanwhile.
+    pthread_mutex_lock(&fs_lock);
+    int entry = find_directory_entry(file);
+    while (entry != -1) {
+        int inode_number = directory_table[entry].inode_number;
+        pthread_mutex_unlock(&fs_lock);
+        pthread_rwlock_wrlock(&inode_locks[inode_number]);
+        pthread_mutex_lock(&fs_lock);
+        entry = find_directory_entry(file);
+        if (entry != -1 && directory_table[entry].inode_number == inode_number) break;
+        pthread_rwlock_unlock(&inode_locks[inode_number]);
     }
 
     // If file exists remove else error
-    if (inode_number != -1) {
-
-        // Remove file from directory tabel table
-        for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
-            if (strcmp(directory_table[i].filename, file) == 0) {
-                directory_table[i].inode_number = -1;
-                strcpy(directory_table[i].filename, "");
-                break;
-            }
-        }
+    if (entry != -1) {
+        int inode_number = directory_table[entry].inode_number;
+
+        // Remove file from directory table (and its index)
+        unindex_directory_entry(entry);
+        directory_table[entry].used = 0;
+        directory_table[entry].inode_number = -1;
+        strcpy(directory_table[entry].filename, "");
+        mark_directory_dirty(entry);
+        push_free_slot(&free_directory_entries, entry);
 
         // Remove file from file descriptor table
-        for (int i = 0; i < MAX_FILE_DESCRIPTOR; i++) {
-            if (file_descriptor_table[i].inode_number == inode_number) {
-                file_descriptor_table[i].inode_number = -1;
-                file_descriptor_table[i].rw_pointer = -1;
-            }
+        if (inode_descriptor[inode_number] != -1) {
+            release_descriptor(&file_descriptor_table[inode_descriptor[inode_number]]);
         }
 
-        // Remove file from inode table
+        // Remove file from inode table. It has no name and no descriptor any more, so
+        // only the inode lock is needed while its blocks are cleared. Held data never
+        // got blocks.
+        discard_delayed(inode_number);
         inode *inode = &inode_table[inode_number];
-
-        void *temp_block = (void *) malloc(BLOCK_SIZE);
-        int last_block = inode->size/BLOCK_SIZE;
-
-        for (int i = 0; i <= last_block; i++) {
-            memset(temp_block, 0, BLOCK_SIZE);
-            // If direct pointer or indirect pointer
-            if (i < 12) {
-                // Clear the block and deallocate the block from free bitmap array
-                write_blocks(inode->direct_ptrs[i], 1, temp_block);
-                deallocate_block_FBM(inode->direct_ptrs[i]);
-                inode->direct_ptrs[i] = -1;
-            } else {
-                // Clear the block and deallocate the block from free bitmap array
-                int indirect_pointers_array[BLOCK_SIZE/sizeof(int)];
-                read_blocks(inode->indirect_ptr, 1, temp_block);
-                memcpy(indirect_pointers_array, temp_block, BLOCK_SIZE);
-                memset(temp_block, 0, BLOCK_SIZE);
-                write_blocks(indirect_pointers_array[i - 12], 1, temp_block);
-                deallocate_block_FBM(indirect_pointers_array[i - 12]);
-                indirect_pointers_array[i - 12] = -1;
-            }
+        int extent_count;
+        extent *extents = load_extents(inode, &extent_count);
+        pthread_mutex_unlock(&fs_lock);
+        int longest = 1;
+        for (int e = 0; e < extent_count; e++) {
+            if (extents[e].length > longest) longest = extents[e].length;
         }
-        // Free up the block
-        deallocate_block_FBM(inode->indirect_ptr);
-        inode->indirect_ptr = -1;
-
-        // Write these changes onto the disk - FLUSH
-        if (write_blocks(INODE_BLOCK_NUMBER + 1, DIRECTORY_BLOCK_NUMBER, &directory_table) > 0 &&
-            write_blocks(BLOCK_NUMBER - FREEBITMAP_BLOCKS - 1, FREEBITMAP_BLOCKS, &free_bitmap_array) > 0 &&  
-            write_blocks(1, INODE_BLOCK_NUMBER, &inode_table) > 0) {
-            free(temp_block);
-            return 1;
-        } else {
-            free(temp_block);
-            printf("Error when writing to blocks!\n");
-            return 0;
+        // Shared source for the clearing writes - one per extent, all queued at once.
+        // The completion queue is shared too, so one remover drains it at a time.
+        void *zero_blocks = (void *) calloc(longest, BLOCK_SIZE);
+        int cleared = 0;
+        pthread_mutex_lock(&zero_write_lock);
+
+        for (int e = 0; e < extent_count; e++) {
+            // Clear the blocks. Writes still cached or parked in the disk's queue would
+            // land after the zeros, so they are dropped first.
+            for (int i = 0; i < extents[e].length; i++) cache_discard(extents[e].start + i);
+            disk_cancel_writes(extents[e].start, extents[e].length);
+            if (disk_submit_write(extents[e].start, extents[e].length, zero_blocks, NULL) < 0) cleared = -1;
+        }
+        if (drain_block_writes() < 0) cleared = -1;
+        pthread_mutex_unlock(&zero_write_lock);
+        free(zero_blocks);
+
+        // Deallocate them from free bitmap array, and free up the indirect and double
+        // indirect extent blocks. Blocks that may not have been cleared stay allocated,
+        // rather than be handed to another file with this one's data in them.
+        pthread_mutex_lock(&fs_lock);
+        for (int e = 0; e < extent_count && cleared == 0; e++) {
+            for (int i = 0; i < extents[e].length; i++) deallocate_block_FBM(extents[e].start + i);
         }
+        mark_inode_dirty(inode_number);
+        free_extent_blocks(inode);
+        store_extents(inode, inode_number, extents, 0);
+        free(extents);
+        // The inode can be given to a new file
+        inode->size = -1;
+        push_free_slot(&free_inodes, inode_number);
+
+        // The changed metadata blocks are written back on the next sfs_fclose, sync or
+        // unmount
+        pthread_mutex_unlock(&fs_lock);
+        pthread_rwlock_unlock(&inode_locks[inode_number]);
+        if (cleared < 0) {
+            printf("Error: could not clear the blocks of %s, they stay allocated\n", file);
+            return -1;
+        }
+        return 1;
     } 
 
+    pthread_mutex_unlock(&fs_lock);
     printf("File not found!\n");
     return -1;
 }
 
 // -------------- Test 2 ------------------
 int sfs_getnextfilename(char *fname) {
-    // Check validity of the current directory filename (the index)
-    if (current_directory_filename >= INODE_DIR_ENTRY_LENGTH) {
-        return -1;
-    }
-
-    // Check if the current directory filename is valid
-    if (directory_table[current_directory_filename].inode_number == -1) {
-        return -1;
+    int result = -1;
+
+    pthread_mutex_lock(&fs_lock);
+    // Check validity of the current directory filename (the index), and
+    // check if the current directory filename is valid
+    if (current_directory_filename < INODE_DIR_ENTRY_LENGTH
+            && directory_table[current_directory_filename].inode_number != -1) {
+        // Copy the filename in the directory table to fname
+        strcpy(fname, directory_table[current_directory_filename].filename);
+        current_directory_filename++;
+        result = 0;
     }
-
-    // Copy the filename in the directory table to fname
-    strcpy(fname, directory_table[current_directory_filename].filename);
-
-    current_directory_filename++;
-    return 0;
+    pthread_mutex_unlock(&fs_lock);
+    return result;
 }
 
-int sfs_getfilesize(const char *path) {
+long long sfs_getfilesize(const char *path) {
     // Find the file and get the size -> return it
-    for (int i = 0; i < INODE_DIR_ENTRY_LENGTH; i++) {
-        if ((directory_table[i].inode_number != -1) && (strcmp(directory_table[i].filename, path) == 0)) {
-            return inode_table[directory_table[i].inode_number].size;
-        } else {
-            continue;
-        }
-    }
-    return -1;
+    long long size = -1;
+
+    pthread_mutex_lock(&fs_lock);
+    int entry = find_directory_entry(path);
+    if (entry != -1) size = file_size(directory_table[entry].inode_number);
+    pthread_mutex_unlock(&fs_lock);
+    return size;
 }
\ No newline at end of file
@@ -5,11 +5,22 @@
 
 #define MAXFILENAME 15
 
+// Geometry of a file system, chosen when it is formatted and kept in its superblock
+typedef struct {
+    int block_size;   // bytes per block, a power of two from 512 to 1 MiB
+    int block_count;  // blocks on the disk
+    int inode_count;  // files the disk can hold (inodes and directory entries)
+} sfs_geometry;
+
+extern const sfs_geometry SFS_GEOMETRY_DEFAULT; // 1024 byte blocks, 4096 blocks, 126 inodes
+
 void mksfs(int);
 
+int mksfs_with_geometry(const sfs_geometry*);
+
 int sfs_getnextfilename(char*);
 
-int sfs_getfilesize(const char*);
+long long sfs_getfilesize(const char*);
 
 int sfs_fopen(char*);
 
@@ -19,7 +30,21 @@ int sfs_fwrite(int, const char*, int);
 
 int sfs_fread(int, char*, int);
 
-int sfs_fseek(int, int);
+// Positional I/O: at the given offset, leaving the descriptor's cursor where it is.
+// Any number of threads may use one descriptor at once. A write past the end of the
+// file fills the gap with zeros.
+int sfs_pwrite(int, const char*, int, long long);
+
+int sfs_pread(int, char*, int, long long);
+
+int sfs_fseek(int, long long);
+
+// Durability: sfs_fsync makes one file's data and metadata reach the device, sfs_sync
+// everything written so far. Otherwise they are written back on sfs_fclose and unmount
+// without waiting for the device. Syncs made at the same time share one flush.
+int sfs_fsync(int);
+
+int sfs_sync();
 
 int sfs_remove(char*);
 
@@ -0,0 +1,398 @@
+/* sfs_bench.c
+ *
+ * Benchmark for the file system on top of the disk emulator.
+ *
+ *   sfs_bench blocks  formats a 64 MiB disk with 1, 4, 16 and 64 KiB blocks
+ *                     and times a 32 MiB file written and read back in
+ *                     64 KiB calls, then 100 small files of 3000 bytes. The
+ *                     device requests each phase issued are counted too.
+ *
+ *   sfs_bench threads  1, 2, 4 and 8 threads each write and read back their
+ *                     own 4 MiB file, then all of them read one 16 MiB file
+ *                     through a single shared descriptor, from its cursor
+ *                     and with sfs_pread at offsets of their own. Aggregate MB/s;
+ *                     DISK_EMU_PROFILE=ssd shows device waits overlapping.
+ *
+ *   sfs_bench seq     streams a 16 MiB file back in 1 KiB and 4 KiB sfs_fread
+ *                     calls with readahead off and on (SFS_READAHEAD_KB=0 and
+ *                     the default), reporting MB/s, device requests and the
+ *                     blocks read ahead.
+ *
+ *   sfs_bench append  appends chunks of 1 to 3000 bytes to 8 files in turn,
+ *                     3 MiB in all, with write-back off and on
+ *                     (SFS_WRITEBACK_KB=0 and the default), then reads every
+ *                     file back. The read requests show how contiguous the
+ *                     files were laid out.
+ *
+ *   sfs_bench sync    1, 2, 4 and 8 threads each append 512 bytes to a file of
+ *                     their own and sfs_fsync it, 200 times. Syncs per second
+ *                     and device requests per sync; syncs made at the same
+ *                     time share one flush, so the requests per sync fall as
+ *                     threads are added.
+ *
+ * Without an argument every benchmark is run. DISK_EMU_PROFILE and
+ * DISK_EMU_BACKEND apply as usual.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+#include "sfs_cache.h"
+
+#define BENCH_DISK_MIB 64
+#define BENCH_FILE_MIB 32
+#define BENCH_CHUNK (64 * 1024)
+#define BENCH_SMALL_FILES 100
+#define BENCH_SMALL_SIZE 3000
+#define BENCH_THREADS_MAX 8
+#define BENCH_THREAD_FILE_MIB 4
+#define BENCH_SHARED_FILE_MIB 16
+#define BENCH_SEQ_FILE_MIB 16
+#define BENCH_APPEND_FILES 8
+#define BENCH_APPEND_MIB 3
+#define BENCH_APPEND_MAX_CHUNK 3000
+#define BENCH_SYNC_SIZE 512
+#define BENCH_SYNC_ROUNDS 200
+
+static double now_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Device requests issued since the last call */
+static long long requests()
+{
+  disk_stats st;
+  disk_get_stats(&st);
+  disk_reset_stats();
+  return st.read_requests + st.write_requests;
+}
+
+/* Streams one large file through a disk formatted with block_size byte
+ * blocks, then creates small files on it.
+ */
+static void bench_blocks(int block_size)
+{
+  sfs_geometry geometry = { block_size, (int)((long long)BENCH_DISK_MIB * 1024 * 1024 / block_size), 126 };
+  char *buffer = malloc(BENCH_CHUNK);
+  long long total = (long long)BENCH_FILE_MIB * 1024 * 1024, done;
+  double start, t_write, t_read, t_small;
+  long long r_write, r_read, r_small;
+  char name[16];
+  int fd, i;
+
+  memset(buffer, 0x6B, BENCH_CHUNK);
+  if (mksfs_with_geometry(&geometry) < 0) {
+    free(buffer);
+    return;
+  }
+
+  requests();
+  start = now_us();
+  fd = sfs_fopen("stream");
+  for (done = 0; done < total; done += BENCH_CHUNK) {
+    if (sfs_fwrite(fd, buffer, BENCH_CHUNK) != BENCH_CHUNK) break;
+  }
+  sfs_fclose(fd);
+  t_write = now_us() - start;
+  r_write = requests();
+
+  start = now_us();
+  fd = sfs_fopen("stream");
+  sfs_fseek(fd, 0);
+  for (done = 0; done < total; done += BENCH_CHUNK) {
+    if (sfs_fread(fd, buffer, BENCH_CHUNK) != BENCH_CHUNK) break;
+  }
+  sfs_fclose(fd);
+  t_read = now_us() - start;
+  r_read = requests();
+
+  start = now_us();
+  for (i = 0; i < BENCH_SMALL_FILES; i++) {
+    snprintf(name, sizeof(name), "small%d", i);
+    fd = sfs_fopen(name);
+    sfs_fwrite(fd, buffer, BENCH_SMALL_SIZE);
+    sfs_fclose(fd);
+  }
+  t_small = now_us() - start;
+  r_small = requests();
+
+  free(buffer);
+  printf("%5d KiB blocks  write %7.1f MB/s %6lld req  read %7.1f MB/s %6lld req  %d small files %8.1f us %5lld req\n",
+         block_size / 1024, total / t_write, r_write, total / t_read, r_read,
+         BENCH_SMALL_FILES, t_small, r_small);
+}
+
+typedef struct {
+  int fd;
+  int write;             /* fill the file instead of reading it */
+  int sync;              /* with write: BENCH_SYNC_SIZE appends, each followed by sfs_fsync */
+  int stride;            /* > 0: sfs_pread every stride-th chunk, from chunk first */
+  int first;
+  long long bytes;       /* bytes to write, or read until end of file */
+  long long done;
+} thread_job;
+
+static void *thread_run(void *arg)
+{
+  thread_job *job = arg;
+  char *buffer = malloc(BENCH_CHUNK);
+  int n;
+
+  memset(buffer, 0x5A, BENCH_CHUNK);
+  job->done = 0;
+  if (job->write && job->sync) {
+    while (job->done < job->bytes && sfs_fwrite(job->fd, buffer, BENCH_SYNC_SIZE) == BENCH_SYNC_SIZE
+           && sfs_fsync(job->fd) == 0) {
+      job->done += BENCH_SYNC_SIZE;
+    }
+  } else if (job->write) {
+    while (job->done < job->bytes && sfs_fwrite(job->fd, buffer, BENCH_CHUNK) == BENCH_CHUNK) {
+      job->done += BENCH_CHUNK;
+    }
+  } else if (job->stride > 0) {
+    long long offset = (long long)job->first * BENCH_CHUNK;
+    for (; (n = sfs_pread(job->fd, buffer, BENCH_CHUNK, offset)) > 0; offset += (long long)job->stride * BENCH_CHUNK) {
+      job->done += n;
+    }
+  } else {
+    while ((n = sfs_fread(job->fd, buffer, BENCH_CHUNK)) > 0) job->done += n;
+  }
+  free(buffer);
+  return NULL;
+}
+
+/* Runs jobs[0..count) on a thread each, returns the aggregate MB/s */
+static double run_jobs(thread_job *jobs, int count)
+{
+  pthread_t threads[BENCH_THREADS_MAX];
+  long long total = 0;
+  double start = now_us();
+  int i;
+
+  for (i = 0; i < count; i++) pthread_create(&threads[i], NULL, thread_run, &jobs[i]);
+  for (i = 0; i < count; i++) pthread_join(threads[i], NULL);
+  for (i = 0; i < count; i++) total += jobs[i].done;
+  return total / (now_us() - start);
+}
+
+/* Threads working on files of their own, then sharing one descriptor */
+static void bench_threads(int count)
+{
+  sfs_geometry geometry = { 4096, 32768, 126 };
+  thread_job jobs[BENCH_THREADS_MAX];
+  long long shared = (long long)BENCH_SHARED_FILE_MIB * 1024 * 1024;
+  double mb_write, mb_read, mb_shared, mb_pread;
+  char name[16];
+  int i, fd;
+
+  if (mksfs_with_geometry(&geometry) < 0) return;
+
+  for (i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "thread%d", i);
+    jobs[i].fd = sfs_fopen(name);
+    jobs[i].write = 1;
+    jobs[i].sync = 0;
+    jobs[i].stride = 0;
+    jobs[i].bytes = (long long)BENCH_THREAD_FILE_MIB * 1024 * 1024;
+  }
+  mb_write = run_jobs(jobs, count);
+
+  for (i = 0; i < count; i++) {
+    sfs_fseek(jobs[i].fd, 0);
+    jobs[i].write = 0;
+  }
+  mb_read = run_jobs(jobs, count);
+  for (i = 0; i < count; i++) sfs_fclose(jobs[i].fd);
+
+  fd = sfs_fopen("shared");
+  jobs[0].fd = fd;
+  jobs[0].write = 1;
+  jobs[0].bytes = shared;
+  run_jobs(jobs, 1);
+  sfs_fseek(fd, 0);
+  for (i = 0; i < count; i++) {
+    jobs[i].fd = fd;
+    jobs[i].write = 0;
+  }
+  mb_shared = run_jobs(jobs, count);
+  /* The cursor hands every chunk to exactly one thread */
+  for (i = 0; i < count; i++) shared -= jobs[i].done;
+
+  for (i = 0; i < count; i++) {
+    jobs[i].stride = count;
+    jobs[i].first = i;
+  }
+  mb_pread = run_jobs(jobs, count);
+  sfs_fclose(fd);
+
+  printf("%d thread%s  write %7.1f MB/s  read %7.1f MB/s  shared fd read %7.1f MB/s  pread %7.1f MB/s%s\n",
+         count, count == 1 ? " " : "s", mb_write, mb_read, mb_shared, mb_pread,
+         shared == 0 ? "" : "  (bytes lost or read twice!)");
+}
+
+/* Reads a file back sequentially in read_size calls, with readahead_kb of readahead */
+static void bench_seq(int read_size, const char *readahead_kb)
+{
+  sfs_geometry geometry = { 1024, 32768, 126 };
+  long long total = (long long)BENCH_SEQ_FILE_MIB * 1024 * 1024, done = 0;
+  char *buffer = malloc(BENCH_CHUNK);
+  sfs_cache_stats cache;
+  double start, t_read;
+  long long r_read;
+  int fd, n;
+
+  setenv("SFS_READAHEAD_KB", readahead_kb, 1);
+  memset(buffer, 0x3C, BENCH_CHUNK);
+  if (mksfs_with_geometry(&geometry) < 0) {
+    free(buffer);
+    return;
+  }
+  fd = sfs_fopen("seq");
+  for (; done < total; done += BENCH_CHUNK) {
+    if (sfs_fwrite(fd, buffer, BENCH_CHUNK) != BENCH_CHUNK) break;
+  }
+  sfs_fclose(fd);
+
+  fd = sfs_fopen("seq");
+  sfs_fseek(fd, 0);
+  requests();
+  sfs_cache_reset_stats();
+  start = now_us();
+  for (done = 0; (n = sfs_fread(fd, buffer, read_size)) > 0; done += n);
+  t_read = now_us() - start;
+  r_read = requests();
+  sfs_cache_get_stats(&cache);
+  sfs_fclose(fd);
+
+  free(buffer);
+  printf("%d KiB reads  readahead %4s KiB  %7.1f MB/s %6lld req  %7lld blocks read ahead%s\n",
+         read_size / 1024, readahead_kb, done / t_read, r_read, cache.readahead,
+         done == total ? "" : "  (short read!)");
+}
+
+/* Threads appending to files of their own, syncing after every append */
+static void bench_sync(int count)
+{
+  thread_job jobs[BENCH_THREADS_MAX];
+  long long bytes = (long long)BENCH_SYNC_SIZE * BENCH_SYNC_ROUNDS, total = 0;
+  double syncs;
+  long long r_sync;
+  char name[16];
+  int i;
+
+  mksfs(1);
+  for (i = 0; i < count; i++) {
+    snprintf(name, sizeof(name), "sync%d", i);
+    jobs[i].fd = sfs_fopen(name);
+    jobs[i].write = 1;
+    jobs[i].sync = 1;
+    jobs[i].stride = 0;
+    jobs[i].bytes = bytes;
+  }
+  requests();
+  syncs = run_jobs(jobs, count) * 1e6 / BENCH_SYNC_SIZE;
+  r_sync = requests();
+  for (i = 0; i < count; i++) {
+    total += jobs[i].done;
+    sfs_fclose(jobs[i].fd);
+  }
+
+  printf("%d thread%s  %8.0f syncs/s  %5.2f req per sync%s\n",
+         count, count == 1 ? " " : "s", syncs, (double)r_sync * BENCH_SYNC_SIZE / (total > 0 ? total : 1),
+         total == bytes * count ? "" : "  (write or sync failed!)");
+}
+
+/* Small interleaved appends to several files, with writeback_kb of write-back */
+static void bench_append(const char *writeback_kb)
+{
+  long long total = (long long)BENCH_APPEND_MIB * 1024 * 1024, done = 0;
+  char *buffer = malloc(BENCH_CHUNK);
+  int fds[BENCH_APPEND_FILES];
+  double start, t_write, t_read;
+  long long r_write, r_read;
+  char name[16];
+  int i, n;
+
+  setenv("SFS_WRITEBACK_KB", writeback_kb, 1);
+  memset(buffer, 0x2D, BENCH_CHUNK);
+  mksfs(1);
+  srand(427);            /* after mksfs: init_fresh_disk seeds rand with the time */
+
+  requests();
+  start = now_us();
+  for (i = 0; i < BENCH_APPEND_FILES; i++) {
+    snprintf(name, sizeof(name), "append%d", i);
+    fds[i] = sfs_fopen(name);
+  }
+  for (i = 0; done < total; i = (i + 1) % BENCH_APPEND_FILES) {
+    n = 1 + rand() % BENCH_APPEND_MAX_CHUNK;
+    if (sfs_fwrite(fds[i], buffer, n) != n) break;
+    done += n;
+  }
+  for (i = 0; i < BENCH_APPEND_FILES; i++) sfs_fclose(fds[i]);
+  t_write = now_us() - start;
+  r_write = requests();
+
+  start = now_us();
+  for (i = 0; i < BENCH_APPEND_FILES; i++) {
+    snprintf(name, sizeof(name), "append%d", i);
+    fds[i] = sfs_fopen(name);
+    sfs_fseek(fds[i], 0);
+    while (sfs_fread(fds[i], buffer, BENCH_CHUNK) > 0);
+    sfs_fclose(fds[i]);
+  }
+  t_read = now_us() - start;
+  r_read = requests();
+
+  free(buffer);
+  printf("write-back %4s KiB  %lld bytes appended %9.1f us %6lld req  read back %8.1f us %5lld req\n",
+         writeback_kb, done, t_write, r_write, t_read, r_read);
+}
+
+int main(int argc, char **argv)
+{
+  static const int block_sizes[] = { 1024, 4096, 16384, 65536 };
+  int run_blocks = (argc < 2 || strcmp(argv[1], "blocks") == 0);
+  int run_threads = (argc < 2 || strcmp(argv[1], "threads") == 0);
+  int run_seq = (argc < 2 || strcmp(argv[1], "seq") == 0);
+  int run_append = (argc < 2 || strcmp(argv[1], "append") == 0);
+  int run_sync = (argc < 2 || strcmp(argv[1], "sync") == 0);
+  int i;
+
+  if (run_blocks) {
+    for (i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++) {
+      bench_blocks(block_sizes[i]);
+    }
+  }
+  if (run_threads) {
+    for (i = 1; i <= BENCH_THREADS_MAX; i *= 2) {
+      bench_threads(i);
+    }
+  }
+  if (run_seq) {
+    bench_seq(1024, "0");
+    bench_seq(1024, "128");
+    bench_seq(4096, "0");
+    bench_seq(4096, "128");
+    unsetenv("SFS_READAHEAD_KB");
+  }
+  if (run_append) {
+    bench_append("0");
+    bench_append("1024");
+    unsetenv("SFS_WRITEBACK_KB");
+  }
+  if (run_sync) {
+    for (i = 1; i <= BENCH_THREADS_MAX; i *= 2) {
+      bench_sync(i);
+    }
+  }
+  remove("sfs.disk");
+  return 0;
+}
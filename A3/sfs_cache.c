@@ -0,0 +1,337 @@
+/* sfs_cache.c
+ *
+ * Block buffer cache between sfs_api.c and the disk emulator. Holds up to a
+ * memory budget of blocks (SFS_CACHE_KB or sfs_cache_set_budget(), 512 KiB by
+ * default, 0 turns the cache off), found through a block number -> slot table.
+ * Eviction is CLOCK: a hand sweeps the slots, clearing reference bits, and
+ * takes the first slot that was not used since its last pass.
+ *
+ * Writes only dirty the cached block. Dirty blocks reach the disk together,
+ * sorted and merged into runs, when cache_flush() is called (sfs_fclose,
+ * mksfs, exit) or when half the cache is dirty. Dirty blocks are never
+ * evicted: a block stays dirty until a write-back of it succeeded.
+ *
+ * Readahead blocks can ride along with a read (cache_read_ahead_v): the
+ * ones not cached are fetched in the same device requests as the misses and
+ * kept for the reads that follow. At most a quarter of the cache is given to
+ * one batch of them.
+ *
+ * Every call may come from any thread. One mutex guards the tables; it is
+ * dropped while misses are read from the disk and while dirty blocks are
+ * written back, so cache users do not wait on each other's I/O. Write-backs
+ * run one at a time, from copies of the blocks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "sfs_cache.h"
+
+extern int BLOCK_SIZE, MAX_BLOCK;
+
+static int capacity = -1;         // slots; -1 until the budget is known
+static int budget_kb = -1;        // -1: SFS_CACHE_KB or the default
+static int *slot_of = NULL;       // block number -> slot, -1 if not cached
+static int *slot_block = NULL;    // slot -> block number, -1 if empty
+static char *slot_dirty = NULL;
+static char *slot_ref = NULL;     // CLOCK reference bit
+static char *slot_flushing = NULL; // being written back by the write-back running
+static unsigned *slot_version = NULL; // bumped on every write, to tell a write-back is current
+static char *slot_data = NULL;
+static int clock_hand = 0;
+static int dirty_count = 0;
+static int mounted_blocks = 0;    // MAX_BLOCK the tables were sized for
+static sfs_cache_stats stats;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_done = PTHREAD_COND_INITIALIZER;
+static bool flush_active = false;
+
+// Sets the memory budget used from the next mount on
+void sfs_cache_set_budget(int kilobytes) {
+    budget_kb = kilobytes;
+}
+
+void sfs_cache_get_stats(sfs_cache_stats *out) {
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void sfs_cache_reset_stats() {
+    pthread_mutex_lock(&cache_lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&cache_lock);
+}
+
+static void flush_at_exit() {
+    cache_flush();
+}
+
+// Drops everything cached and sizes the cache for the disk just initialized.
+// Dirty blocks of the previous disk have to be flushed before it is replaced.
+void cache_mount() {
+    static int registered = 0;
+    int kb = budget_kb;
+
+    if (kb < 0) kb = (getenv("SFS_CACHE_KB") != NULL) ? atoi(getenv("SFS_CACHE_KB")) : SFS_CACHE_DEFAULT_KB;
+    capacity = (int)((long long)kb * 1024 / BLOCK_SIZE);
+    if (capacity > MAX_BLOCK) capacity = MAX_BLOCK;
+
+    pthread_mutex_lock(&cache_lock);
+    free(slot_of);
+    free(slot_block);
+    free(slot_dirty);
+    free(slot_ref);
+    free(slot_flushing);
+    free(slot_version);
+    free(slot_data);
+    slot_of = malloc(MAX_BLOCK * sizeof(int));
+    slot_block = malloc((capacity + 1) * sizeof(int));
+    slot_dirty = calloc(capacity + 1, 1);
+    slot_ref = calloc(capacity + 1, 1);
+    slot_flushing = calloc(capacity + 1, 1);
+    slot_version = calloc(capacity + 1, sizeof(unsigned));
+    slot_data = malloc((size_t)(capacity + 1) * BLOCK_SIZE);
+    for (int i = 0; i < MAX_BLOCK; i++) slot_of[i] = -1;
+    for (int i = 0; i < capacity; i++) slot_block[i] = -1;
+    clock_hand = 0;
+    dirty_count = 0;
+    mounted_blocks = MAX_BLOCK;
+    pthread_mutex_unlock(&cache_lock);
+
+    if (!registered) {
+        atexit(flush_at_exit);
+        registered = 1;
+    }
+}
+
+// Writes every dirty block back with one write_blocks_v call, which sorts them
+// and merges adjacent blocks into single requests. Called with cache_lock held,
+// which is dropped during the write: the blocks are copied first, and only those
+// not written again meanwhile are clean afterwards - if the write succeeded.
+static int flush_locked() {
+    block_iovec *vec;
+    int *slots;
+    unsigned *versions;
+    char *copies;
+    int count = 0, result = 0;
+
+    if (capacity <= 0 || slot_of == NULL) return 0;
+    // One write-back at a time, or an older copy could land after a newer one
+    while (flush_active) pthread_cond_wait(&flush_done, &cache_lock);
+    if (dirty_count == 0) return 0;
+    flush_active = true;
+
+    vec = malloc(dirty_count * sizeof(block_iovec));
+    slots = malloc(dirty_count * sizeof(int));
+    versions = malloc(dirty_count * sizeof(unsigned));
+    copies = malloc((size_t)dirty_count * BLOCK_SIZE);
+    for (int i = 0; i < capacity; i++) {
+        if (slot_block[i] == -1 || !slot_dirty[i]) continue;
+        vec[count].block = slot_block[i];
+        vec[count].buffer = copies + (size_t)count * BLOCK_SIZE;
+        memcpy(vec[count].buffer, slot_data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+        slots[count] = i;
+        versions[count] = slot_version[i];
+        slot_flushing[i] = 1;
+        count++;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+    if (write_blocks_v(vec, count) < 0) {
+        printf("Error: cache write-back failed\n");
+        result = -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+
+    // Dirty slots are not evicted, so each still holds its block (or was discarded)
+    for (int i = 0; i < count; i++) {
+        slot_flushing[slots[i]] = 0;
+        if (result < 0 || slot_version[slots[i]] != versions[i] || !slot_dirty[slots[i]]) continue;
+        slot_dirty[slots[i]] = 0;
+        dirty_count--;
+    }
+    if (result == 0) stats.writebacks += count;
+    flush_active = false;
+    pthread_cond_broadcast(&flush_done);
+    free(vec);
+    free(slots);
+    free(versions);
+    free(copies);
+    return result;
+}
+
+int cache_flush() {
+    int result;
+
+    pthread_mutex_lock(&cache_lock);
+    result = flush_locked();
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+// Finds a slot for block: an empty one, or the CLOCK victim among the clean
+// ones. Returns -1 if every slot is dirty.
+static int take_slot(int block) {
+    int slot, steps;
+
+    for (steps = 0; ; steps++) {
+        if (steps == 2 * capacity) return -1;
+        slot = clock_hand;
+        clock_hand = (clock_hand + 1) % capacity;
+        if (slot_block[slot] == -1) break;
+        if (slot_ref[slot]) {
+            slot_ref[slot] = 0;
+            continue;
+        }
+        if (slot_dirty[slot]) continue;
+        slot_of[slot_block[slot]] = -1;
+        stats.evictions++;
+        break;
+    }
+    slot_block[slot] = block;
+    slot_of[block] = slot;
+    slot_dirty[slot] = 0;
+    slot_ref[slot] = 1;
+    return slot;
+}
+
+static int cache_off() {
+    return capacity <= 0 || slot_of == NULL || mounted_blocks != MAX_BLOCK;
+}
+
+// Reads count scattered blocks. Misses are read from the disk in one
+// read_blocks_v call, straight into the caller's buffers, then cached.
+// The ahead blocks that are not cached are read in the same call, into
+// buffers of the cache's own, and cached too.
+int cache_read_ahead_v(block_iovec *vec, int count, const int *ahead, int ahead_count) {
+    block_iovec *miss;
+    char *ahead_data = NULL;
+    int misses = 0, demand_misses;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_off()) {
+        pthread_mutex_unlock(&cache_lock);
+        return read_blocks_v(vec, count);
+    }
+    if (ahead_count > capacity / 4) ahead_count = capacity / 4;
+
+    miss = malloc((count + ahead_count) * sizeof(block_iovec));
+    for (int i = 0; i < count; i++) {
+        int slot = slot_of[vec[i].block];
+        if (slot == -1) {
+            miss[misses++] = vec[i];
+            continue;
+        }
+        memcpy(vec[i].buffer, slot_data + (size_t)slot * BLOCK_SIZE, BLOCK_SIZE);
+        slot_ref[slot] = 1;
+        stats.hits++;
+    }
+    demand_misses = misses;
+    for (int i = 0; i < ahead_count; i++) {
+        if (slot_of[ahead[i]] != -1) continue;
+        if (ahead_data == NULL) ahead_data = malloc((size_t)ahead_count * BLOCK_SIZE);
+        miss[misses].block = ahead[i];
+        miss[misses].buffer = ahead_data + (size_t)(misses - demand_misses) * BLOCK_SIZE;
+        misses++;
+    }
+
+    pthread_mutex_unlock(&cache_lock);
+
+    // read_blocks_v sorts the vector in place - tell the two kinds apart by buffer
+    if (misses > 0 && read_blocks_v(miss, misses) < 0) {
+        free(ahead_data);
+        free(miss);
+        return -1;
+    }
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < misses; i++) {
+        bool is_ahead = ahead_data != NULL && (char *)miss[i].buffer >= ahead_data
+                && (char *)miss[i].buffer < ahead_data + (size_t)ahead_count * BLOCK_SIZE;
+        // The same block may be asked for twice in one vector, or have been
+        // cached by another reader while the lock was dropped
+        int slot;
+        if (cache_off() || slot_of[miss[i].block] != -1) continue;
+        // The cache is all dirty - the block is just not kept
+        if ((slot = take_slot(miss[i].block)) == -1) continue;
+        memcpy(slot_data + (size_t)slot * BLOCK_SIZE, miss[i].buffer, BLOCK_SIZE);
+        if (is_ahead) stats.readahead++;
+        else stats.misses++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(ahead_data);
+    free(miss);
+    return count;
+}
+
+int cache_read_v(block_iovec *vec, int count) {
+    return cache_read_ahead_v(vec, count, NULL, 0);
+}
+
+// Writes count scattered blocks into the cache, where they stay dirty until flushed.
+// Once half the cache is dirty, everything dirty is written back.
+int cache_write_v(block_iovec *vec, int count) {
+    int result = count;
+
+    pthread_mutex_lock(&cache_lock);
+    if (cache_off()) {
+        pthread_mutex_unlock(&cache_lock);
+        return write_blocks_v(vec, count);
+    }
+
+    for (int i = 0; i < count; i++) {
+        int slot = slot_of[vec[i].block];
+        // No clean slot left: write the dirty ones back to make room. The lock is
+        // dropped meanwhile, so look the block up again.
+        while (slot == -1 && (slot = take_slot(vec[i].block)) == -1) {
+            if (flush_locked() < 0 || cache_off()) break;
+            slot = slot_of[vec[i].block];
+        }
+        if (slot == -1) {
+            // The rest goes around the cache, so copies of it still cached are stale
+            // and a dirty one would be written back over the new data
+            pthread_mutex_unlock(&cache_lock);
+            for (int j = i; j < count; j++) cache_discard(vec[j].block);
+            return (write_blocks_v(vec + i, count - i) < 0) ? -1 : count;
+        }
+        memcpy(slot_data + (size_t)slot * BLOCK_SIZE, vec[i].buffer, BLOCK_SIZE);
+        if (!slot_dirty[slot]) dirty_count++;
+        slot_dirty[slot] = 1;
+        slot_ref[slot] = 1;
+        slot_version[slot]++;
+    }
+    if (dirty_count >= capacity / 2 && !flush_active && flush_locked() < 0) result = -1;
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+int cache_read(int block, void *buffer) {
+    block_iovec vec = { block, buffer };
+    return cache_read_v(&vec, 1);
+}
+
+int cache_write(int block, const void *buffer) {
+    block_iovec vec = { block, (void *)buffer };
+    return cache_write_v(&vec, 1);
+}
+
+// Forgets a block without writing it back, for blocks that were freed or are about
+// to be written around the cache. A write-back of the block already under way is
+// waited for, so it cannot land after the caller's own write.
+void cache_discard(int block) {
+    int slot;
+
+    pthread_mutex_lock(&cache_lock);
+    while (!cache_off() && slot_of[block] != -1 && slot_flushing[slot_of[block]]) {
+        pthread_cond_wait(&flush_done, &cache_lock);
+    }
+    if (!cache_off() && slot_of[block] != -1) {
+        slot = slot_of[block];
+        slot_of[block] = -1;
+        slot_block[slot] = -1;
+        if (slot_dirty[slot]) dirty_count--;
+        slot_dirty[slot] = 0;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,32 @@
+#ifndef SFS_CACHE_H
+#define SFS_CACHE_H
+
+#include "disk_emu.h"
+
+// Block buffer cache between sfs_api.c and the disk emulator. Blocks are
+// BLOCK_SIZE bytes, evicted with CLOCK, and written back when dirty.
+
+#define SFS_CACHE_DEFAULT_KB 512  // memory budget when none is set
+
+typedef struct {
+    long long hits;        // blocks found in the cache
+    long long misses;      // blocks read from the disk
+    long long evictions;
+    long long writebacks;  // dirty blocks written to the disk
+    long long readahead;   // blocks read from the disk ahead of being asked for
+} sfs_cache_stats;
+
+void sfs_cache_set_budget(int kilobytes);
+void sfs_cache_get_stats(sfs_cache_stats *out);
+void sfs_cache_reset_stats();
+
+void cache_mount();
+int cache_read(int block, void *buffer);
+int cache_write(int block, const void *buffer);
+int cache_read_v(block_iovec *vec, int count);
+int cache_read_ahead_v(block_iovec *vec, int count, const int *ahead, int ahead_count);
+int cache_write_v(block_iovec *vec, int count);
+void cache_discard(int block);
+int cache_flush();
+
+#endif
@@ -0,0 +1,211 @@
+/* sfs_test3.c
+ *
+ * Mounts an image in the layout of the original handout file system
+ * (magic 0xACBD0005: block pointer inodes, one int per block in a 16
+ * block free bitmap), writes new files to it and checks that the files
+ * it came with survive the conversion, the new writes and a remount.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk_emu.h"
+#include "sfs_api.h"
+
+/* Layout of the original file system
+ */
+#define OLD_MAGIC 0xACBD0005
+#define OLD_BLOCK_SIZE 1024
+#define OLD_BLOCK_NUMBER 4096
+#define OLD_INODE_BLOCKS 7
+#define OLD_DIRECTORY_BLOCKS 3
+#define OLD_BITMAP_BLOCKS 16
+#define OLD_ENTRIES 126
+#define OLD_DIRECT_PTR 12
+
+typedef struct {
+  int magic;
+  int block_size;
+  int file_system_size;
+  int inode_table_length;
+  int root_directory;
+} old_super_block;
+
+typedef struct {
+  int size;
+  int direct_ptrs[OLD_DIRECT_PTR];
+  int indirect_ptr;
+} old_inode;
+
+typedef struct {
+  int used;
+  int inode_number;
+  char filename[16];
+} old_directory_entry;
+
+#define OLD_FILES 3
+#define NEW_FILES 8
+#define NEW_BYTES 30000 /* 8 files of 30 blocks, past the 127 blocks a misread bitmap leaves */
+
+static char *old_names[OLD_FILES] = { "old1", "old2", "old3" };
+static int old_sizes[OLD_FILES] = { 3000, 12288, 40000 }; /* old3 needs the indirect block */
+
+/* fill() - the contents file number n is expected to hold
+ */
+static void fill(char *buf, int size, int n)
+{
+  int i;
+
+  for (i = 0; i < size; i++) {
+    buf[i] = 'a' + (i * 7 + n * 3) % 26;
+  }
+}
+
+/* write_old_image() - formats sfs.disk the way the original mksfs(1) did
+ * and writes the old files into it, allocating blocks first fit as it did.
+ */
+static void write_old_image()
+{
+  static old_inode inodes[OLD_INODE_BLOCKS * OLD_BLOCK_SIZE / sizeof(old_inode)];
+  static old_directory_entry directory[OLD_DIRECTORY_BLOCKS * OLD_BLOCK_SIZE / sizeof(old_directory_entry)];
+  static int bitmap[OLD_BLOCK_NUMBER];
+  static char block[OLD_BLOCK_SIZE];
+  int pointers[OLD_BLOCK_SIZE / sizeof(int)];
+  old_super_block super_block = { OLD_MAGIC, OLD_BLOCK_SIZE, OLD_BLOCK_NUMBER, OLD_INODE_BLOCKS, 0 };
+  int next = 1 + OLD_INODE_BLOCKS + OLD_DIRECTORY_BLOCKS;
+  int i, j;
+
+  init_fresh_disk("sfs.disk", OLD_BLOCK_SIZE, OLD_BLOCK_NUMBER);
+
+  for (i = 0; i < OLD_BLOCK_NUMBER; i++) {
+    bitmap[i] = (i < next || i >= OLD_BLOCK_NUMBER - OLD_BITMAP_BLOCKS - 1) ? 0 : 1;
+  }
+  for (i = 0; i < OLD_ENTRIES; i++) {
+    inodes[i].size = -1;
+    inodes[i].indirect_ptr = -1;
+    for (j = 0; j < OLD_DIRECT_PTR; j++) {
+      inodes[i].direct_ptrs[j] = -1;
+    }
+    directory[i].inode_number = -1;
+  }
+  directory[0].used = 1;
+  directory[0].inode_number = 0;
+  inodes[0].size = 0;
+
+  for (i = 0; i < OLD_FILES; i++) {
+    char *data = malloc(old_sizes[i]);
+    int blocks = (old_sizes[i] + OLD_BLOCK_SIZE - 1) / OLD_BLOCK_SIZE;
+
+    fill(data, old_sizes[i], i);
+    memset(pointers, 0xFF, sizeof(pointers));
+    for (j = 0; j < blocks; j++) {
+      if (j == OLD_DIRECT_PTR) {
+        inodes[i + 1].indirect_ptr = next;
+        bitmap[next++] = 0;
+      }
+      memset(block, 0, sizeof(block));
+      memcpy(block, data + j * OLD_BLOCK_SIZE, j < blocks - 1 ? OLD_BLOCK_SIZE : old_sizes[i] - j * OLD_BLOCK_SIZE);
+      write_blocks(next, 1, block);
+      if (j < OLD_DIRECT_PTR) {
+        inodes[i + 1].direct_ptrs[j] = next;
+      }
+      else {
+        pointers[j - OLD_DIRECT_PTR] = next;
+      }
+      bitmap[next++] = 0;
+    }
+    if (inodes[i + 1].indirect_ptr != -1) {
+      write_blocks(inodes[i + 1].indirect_ptr, 1, pointers);
+    }
+    inodes[i + 1].size = old_sizes[i];
+    directory[i + 1].used = 1;
+    directory[i + 1].inode_number = i + 1;
+    strcpy(directory[i + 1].filename, old_names[i]);
+    free(data);
+  }
+
+  memset(block, 0, sizeof(block));
+  memcpy(block, &super_block, sizeof(super_block));
+  write_blocks(0, 1, block);
+  write_blocks(1, OLD_INODE_BLOCKS, inodes);
+  write_blocks(1 + OLD_INODE_BLOCKS, OLD_DIRECTORY_BLOCKS, directory);
+  write_blocks(OLD_BLOCK_NUMBER - OLD_BITMAP_BLOCKS - 1, OLD_BITMAP_BLOCKS, bitmap);
+  close_disk();
+}
+
+/* check_file() - returns the number of errors found reading a file back
+ */
+static int check_file(char *name, int size, int n)
+{
+  char *expected = malloc(size);
+  char *buf = malloc(size + 1);
+  int errors = 0;
+  int fd;
+
+  fill(expected, size, n);
+  fd = sfs_fopen(name);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: cannot open %s\n", name);
+    errors++;
+  }
+  else {
+    sfs_fseek(fd, 0);
+    if (sfs_getfilesize(name) != size) {
+      fprintf(stderr, "ERROR: %s has size %lld, expected %d\n", name, sfs_getfilesize(name), size);
+      errors++;
+    }
+    if (sfs_fread(fd, buf, size + 1) != size || memcmp(buf, expected, size) != 0) {
+      fprintf(stderr, "ERROR: wrong data read back from %s\n", name);
+      errors++;
+    }
+    sfs_fclose(fd);
+  }
+  free(expected);
+  free(buf);
+  return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+  char *buf = malloc(NEW_BYTES);
+  char name[16];
+  int error_count = 0;
+  int i, fd;
+
+  write_old_image();
+  mksfs(0);
+
+  for (i = 0; i < OLD_FILES; i++) {
+    error_count += check_file(old_names[i], old_sizes[i], i);
+  }
+
+  for (i = 0; i < NEW_FILES; i++) {
+    sprintf(name, "new%d", i);
+    fill(buf, NEW_BYTES, OLD_FILES + i);
+    fd = sfs_fopen(name);
+    if (fd < 0 || sfs_fwrite(fd, buf, NEW_BYTES) != NEW_BYTES) {
+      fprintf(stderr, "ERROR: cannot write %s\n", name);
+      error_count++;
+    }
+    sfs_fclose(fd);
+  }
+  for (i = 0; i < OLD_FILES; i++) {
+    error_count += check_file(old_names[i], old_sizes[i], i);
+  }
+
+  /* Once more from the converted image
+   */
+  mksfs(0);
+  for (i = 0; i < OLD_FILES; i++) {
+    error_count += check_file(old_names[i], old_sizes[i], i);
+  }
+  for (i = 0; i < NEW_FILES; i++) {
+    sprintf(name, "new%d", i);
+    error_count += check_file(name, NEW_BYTES, OLD_FILES + i);
+  }
+
+  free(buf);
+  fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+  return (error_count);
+}